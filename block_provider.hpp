@@ -1,42 +1,592 @@
 #pragma once
-#include <unordered_map>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 namespace block_provider
 {
-	size_t last_block_id_ = 1, read_count_ = 0, block_in_memory_ = 0;
-	std::unordered_map<size_t, void*> blocks_;
+	const size_t page_size_ = 4096;
+	const size_t huge_page_size_ = size_t(2) << 20;
+	const size_t default_shards_ = 16;
+	const size_t header_size_ = 16; // count and ID of next block, at the start of every block
 
-	inline size_t create_block(size_t block_size)
+	inline size_t round_to_page(size_t size)
 	{
-		auto block_id = last_block_id_++;
-		blocks_[block_id] = malloc(block_size);
-		memset(blocks_[block_id], 0, block_size);
-		return block_id;
+		return (size + page_size_ - 1) / page_size_ * page_size_;
 	}
 
-	inline void* load_block(size_t block_id)
+	// block loads served from memory / from storage, frames evicted and dirty frames written back,
+	// bytes transferred from / to storage
+	struct provider_stats
+	{
+		size_t hits = 0, misses = 0, evictions = 0, writebacks = 0;
+		size_t bytes_read = 0, bytes_written = 0;
+	};
+
+	// Transforms blocks on their way to and from storage, e.g. compresses them. Must be thread-safe.
+	// Encoded blocks are self-describing: their size can be told from their first bytes.
+	class block_codec
+	{
+	public:
+		virtual ~block_codec() {}
+
+		// encodes the block of block_size bytes into out (block_size bytes available), returns the encoded size
+		virtual size_t encode(const void* block, size_t block_size, void* out) const = 0;
+		// size of the encoded block starting with head, head holds at least min(page_size_, block_size) bytes
+		virtual size_t encoded_size(const void* head, size_t block_size) const = 0;
+		virtual void decode(const void* in, size_t size, void* block, size_t block_size) const = 0;
+	};
+
+	// Storage for the blocks of one or more isam instances, all operations are thread-safe.
+	// Block IDs start at 1, 0 means "no block", the IDs of freed blocks are reused. A pointer returned by load_block
+	// stays valid until the matching store_block (the block was modified) or release_block (the block was only read).
+	// create_block returns a block whose header (the first header_size_ bytes) is zero, the rest is unspecified.
+	class provider
+	{
+	public:
+		virtual ~provider() {}
+
+		// number of bytes a block of the given size occupies in this provider
+		virtual size_t aligned_block_size(size_t block_size) const { return block_size; }
+
+		virtual size_t create_block(size_t block_size) = 0;
+		virtual void* load_block(size_t block_id) = 0;
+		virtual void store_block(size_t block_id) = 0;
+		virtual void release_block(size_t block_id) = 0;
+		virtual void free_block(size_t block_id) = 0;
+		virtual provider_stats stats() const = 0;
+	};
+
+	// Hands out block IDs from 1 on, the IDs of freed blocks first (the latest one first, its data may still be
+	// cached). Thread-safe.
+	class id_allocator
 	{
-		++read_count_;
-		++block_in_memory_;
+	public:
+		size_t allocate()
+		{
+			std::lock_guard<std::mutex> lock(latch_);
+			if (free_ids_.empty()) return next_id_.fetch_add(1);
+			size_t block_id = free_ids_.back();
+			free_ids_.pop_back();
+			return block_id;
+		}
 
-		//if not exist
-		if (blocks_.find(block_id) == blocks_.end())
+		void free(size_t block_id)
 		{
-			return nullptr;
+			std::lock_guard<std::mutex> lock(latch_);
+			free_ids_.push_back(block_id);
 		}
-		return blocks_[block_id];
-	}
 
-	inline void store_block(size_t block_id, void* block_ptr)
+		// whether the ID has ever been handed out
+		bool issued(size_t block_id) const { return block_id != 0 && block_id < next_id_.load(); }
+
+	private:
+		std::mutex latch_;
+		std::vector<size_t> free_ids_;
+		std::atomic<size_t> next_id_{ 1 };
+	};
+
+	// Carves blocks of one size out of large chunks of memory, mapped zeroed and aligned to huge_page_size_, so that
+	// blocks lie next to each other without allocator headers in between and few TLB entries cover them. Freed blocks
+	// are kept in a free list and handed out again first. Not thread-safe.
+	class block_arena
 	{
-		--block_in_memory_;
-		blocks_[block_id] = block_ptr;
-	}
+	public:
+		// with huge_pages, the chunks are backed by transparent huge pages where the system supports it
+		block_arena(size_t block_size, bool huge_pages)
+			: stride_((block_size + 63) / 64 * 64), huge_pages_(huge_pages)
+		{
+			chunk_bytes_ = (stride_ * 8 + huge_page_size_ - 1) / huge_page_size_ * huge_page_size_; // at least 8 blocks
+			carved_ = blocks_per_chunk(); // no chunk yet
+		}
+
+		block_arena(const block_arena&) = delete;
+		block_arena& operator=(const block_arena&) = delete;
 
-	inline void free_block(size_t block_id)
+		~block_arena()
+		{
+			for (char* chunk : chunks_) ::munmap(chunk, chunk_bytes_);
+		}
+
+		// a block with a zero header, fresh blocks are zero throughout
+		void* allocate()
+		{
+			if (!free_.empty())
+			{
+				void* block = free_.back();
+				free_.pop_back();
+				memset(block, 0, header_size_);
+				return block;
+			}
+			if (carved_ == blocks_per_chunk()) add_chunk();
+			return chunks_.back() + stride_ * carved_++;
+		}
+
+		void deallocate(void* block) { free_.push_back(block); }
+
+		// bytes mapped for blocks
+		size_t reserved_bytes() const { return chunks_.size() * chunk_bytes_; }
+
+	private:
+		size_t stride_; // block size rounded up to cache lines
+		bool huge_pages_;
+		size_t chunk_bytes_;
+		std::vector<char*> chunks_;
+		size_t carved_; // blocks handed out from the last chunk
+		std::vector<void*> free_;
+
+		size_t blocks_per_chunk() const { return chunk_bytes_ / stride_; }
+
+		void add_chunk()
+		{
+			// map one huge page more and unmap around the aligned chunk
+			size_t bytes = chunk_bytes_ + huge_page_size_;
+			void* raw = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (raw == MAP_FAILED) throw std::bad_alloc();
+			uintptr_t start = (reinterpret_cast<uintptr_t>(raw) + huge_page_size_ - 1) / huge_page_size_ * huge_page_size_;
+			size_t head = start - reinterpret_cast<uintptr_t>(raw), tail = bytes - head - chunk_bytes_;
+			if (head != 0) ::munmap(raw, head);
+			if (tail != 0) ::munmap(reinterpret_cast<void*>(start + chunk_bytes_), tail);
+			char* chunk = reinterpret_cast<char*>(start);
+#ifdef MADV_HUGEPAGE
+			if (huge_pages_) ::madvise(chunk, chunk_bytes_, MADV_HUGEPAGE);
+#endif
+			chunks_.push_back(chunk);
+			carved_ = 0;
+		}
+	};
+
+	// Blocks kept in process memory, carved out of a block_arena per block size.
+	// The block table is split into shards by block ID, each with its own latch, so that threads working on
+	// different blocks rarely contend.
+	class memory_provider : public provider
 	{
-		free(blocks_[block_id]);
-		blocks_.erase(block_id);
-	}
-}
\ No newline at end of file
+	public:
+		// with huge_pages, block memory is backed by transparent huge pages where the system supports it
+		explicit memory_provider(size_t shards = default_shards_, bool huge_pages = false)
+			: shards_(shards == 0 ? 1 : shards), huge_pages_(huge_pages) {}
+
+		memory_provider(const memory_provider&) = delete;
+		memory_provider& operator=(const memory_provider&) = delete;
+
+		size_t create_block(size_t block_size) override
+		{
+			size_t block_id = ids_.allocate();
+			void* data;
+			{
+				std::lock_guard<std::mutex> lock(arena_latch_);
+				auto& arena = arenas_[block_size];
+				if (!arena) arena.reset(new block_arena(block_size, huge_pages_));
+				data = arena->allocate();
+			}
+			auto& s = shard(block_id);
+			std::lock_guard<std::mutex> lock(s.latch);
+			s.blocks[block_id] = block_entry{ data, block_size };
+			return block_id;
+		}
+
+		void* load_block(size_t block_id) override
+		{
+			auto& s = shard(block_id);
+			std::lock_guard<std::mutex> lock(s.latch);
+			auto it = s.blocks.find(block_id);
+			//if not exist
+			if (it == s.blocks.end()) return nullptr;
+			++s.hits;
+			return it->second.data;
+		}
+
+		void store_block(size_t) override {} // blocks never leave memory
+		void release_block(size_t) override {}
+
+		void free_block(size_t block_id) override
+		{
+			block_entry block;
+			{
+				auto& s = shard(block_id);
+				std::lock_guard<std::mutex> lock(s.latch);
+				auto it = s.blocks.find(block_id);
+				if (it == s.blocks.end()) return;
+				block = it->second;
+				s.blocks.erase(it);
+			}
+			{
+				std::lock_guard<std::mutex> lock(arena_latch_);
+				arenas_[block.size]->deallocate(block.data);
+			}
+			ids_.free(block_id);
+		}
+
+		provider_stats stats() const override
+		{
+			provider_stats result;
+			for (auto&& s : shards_)
+			{
+				std::lock_guard<std::mutex> lock(s.latch);
+				result.hits += s.hits;
+			}
+			return result;
+		}
+
+		// bytes mapped for blocks, in use or free
+		size_t reserved_bytes() const
+		{
+			std::lock_guard<std::mutex> lock(arena_latch_);
+			size_t result = 0;
+			for (auto&& a : arenas_) result += a.second->reserved_bytes();
+			return result;
+		}
+
+		// blocks created and not freed yet
+		size_t blocks() const
+		{
+			size_t result = 0;
+			for (auto&& s : shards_)
+			{
+				std::lock_guard<std::mutex> lock(s.latch);
+				result += s.blocks.size();
+			}
+			return result;
+		}
+
+	private:
+		struct block_entry
+		{
+			void* data;
+			size_t size; // selects its arena
+		};
+
+		struct shard_t
+		{
+			mutable std::mutex latch;
+			std::unordered_map<size_t, block_entry> blocks;
+			size_t hits = 0;
+		};
+
+		std::vector<shard_t> shards_;
+		bool huge_pages_;
+		id_allocator ids_;
+		mutable std::mutex arena_latch_;
+		std::unordered_map<size_t, std::unique_ptr<block_arena>> arenas_; // by block size
+
+		shard_t& shard(size_t block_id) { return shards_[block_id % shards_.size()]; }
+	};
+
+	// Blocks kept in a data file (created or truncated), block N at offset (N - 1) * slot size.
+	// The slot size is the largest block size rounded up to whole pages. With a codec, only the encoded bytes of a
+	// block are written to its slot and read back.
+	// Blocks are cached in a buffer pool of page-aligned frames, split into shards by block ID. Every shard has a
+	// latch and a share of the memory budget, and replaces its frames with CLOCK. load_block pins a frame,
+	// store_block unpins it and marks it dirty, release_block unpins it unchanged. Dirty frames are written back
+	// when they are evicted, on flush() and on destruction. A shard whose frames are all pinned exceeds its budget
+	// rather than fail.
+	class file_provider : public provider
+	{
+	public:
+		file_provider(const std::string& path, size_t block_size, size_t memory_budget = size_t(64) << 20, size_t shards = default_shards_,
+			const block_codec* codec = nullptr)
+			: slot_size_(round_to_page(block_size)), shards_(shards == 0 ? 1 : shards), codec_(codec)
+		{
+			file_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (file_ < 0) throw std::system_error(errno, std::generic_category(), "block_provider: open " + path);
+			size_t frames = memory_budget / slot_size_ / shards_.size();
+			for (auto&& s : shards_) s.pool_frames = frames == 0 ? 1 : frames;
+		}
+
+		file_provider(const file_provider&) = delete;
+		file_provider& operator=(const file_provider&) = delete;
+
+		~file_provider() override
+		{
+			try { flush(); } catch (...) {} // nobody left to report a failed write to
+			for (auto&& s : shards_)
+			{
+				for (auto&& f : s.frames) free(f.data);
+			}
+			::close(file_);
+		}
+
+		size_t aligned_block_size(size_t block_size) const override
+		{
+			return round_to_page(block_size);
+		}
+
+		// writes all dirty frames back to the data file
+		void flush()
+		{
+			for (auto&& s : shards_)
+			{
+				std::lock_guard<std::mutex> lock(s.latch);
+				for (auto&& f : s.frames)
+				{
+					if (f.block_id != 0 && f.dirty)
+					{
+						write_slot(s, f.block_id, f.data);
+						++s.writebacks;
+						f.dirty = false;
+					}
+				}
+			}
+		}
+
+		size_t create_block(size_t block_size) override
+		{
+			if (block_size > slot_size_) throw std::length_error("block_provider: block larger than the file slot");
+			size_t block_id = ids_.allocate(); // a freed ID reuses its file slot
+			auto& s = shard(block_id);
+			std::lock_guard<std::mutex> lock(s.latch);
+			size_t idx = grab_frame(s);
+			frame& f = s.frames[idx];
+			memset(f.data, 0, slot_size_);
+			f.block_id = block_id;
+			f.dirty = true; // written out when evicted, there is nothing to read back before that
+			f.referenced = true;
+			s.page_table[block_id] = idx;
+			return block_id;
+		}
+
+		void* load_block(size_t block_id) override
+		{
+			if (!ids_.issued(block_id)) return nullptr;
+			auto& s = shard(block_id);
+			std::lock_guard<std::mutex> lock(s.latch);
+			size_t idx;
+			auto it = s.page_table.find(block_id);
+			if (it != s.page_table.end())
+			{
+				++s.hits;
+				idx = it->second;
+			}
+			else // not cached -> read it from the file
+			{
+				++s.misses;
+				idx = grab_frame(s);
+				read_slot(s, block_id, s.frames[idx].data);
+				s.frames[idx].block_id = block_id;
+				s.page_table[block_id] = idx;
+			}
+			frame& f = s.frames[idx];
+			++f.pins;
+			f.referenced = true;
+			return f.data;
+		}
+
+		void store_block(size_t block_id) override
+		{
+			auto& s = shard(block_id);
+			std::lock_guard<std::mutex> lock(s.latch);
+			auto it = s.page_table.find(block_id);
+			if (it == s.page_table.end()) return;
+			frame& f = s.frames[it->second];
+			assert(f.pins > 0); // every store_block or release_block ends one load_block
+			--f.pins;
+			f.dirty = true;
+		}
+
+		void release_block(size_t block_id) override
+		{
+			auto& s = shard(block_id);
+			std::lock_guard<std::mutex> lock(s.latch);
+			auto it = s.page_table.find(block_id);
+			if (it == s.page_table.end()) return;
+			frame& f = s.frames[it->second];
+			assert(f.pins > 0);
+			--f.pins;
+		}
+
+		void free_block(size_t block_id) override
+		{
+			auto& s = shard(block_id);
+			std::lock_guard<std::mutex> lock(s.latch);
+			auto it = s.page_table.find(block_id);
+			if (it != s.page_table.end())
+			{
+				frame& f = s.frames[it->second];
+				f.block_id = 0;
+				f.pins = 0;
+				f.dirty = false;
+				f.referenced = false;
+				s.page_table.erase(it);
+			}
+			ids_.free(block_id);
+		}
+
+		provider_stats stats() const override
+		{
+			provider_stats result;
+			for (auto&& s : shards_)
+			{
+				std::lock_guard<std::mutex> lock(s.latch);
+				result.hits += s.hits;
+				result.misses += s.misses;
+				result.evictions += s.evictions;
+				result.writebacks += s.writebacks;
+				result.bytes_read += s.bytes_read;
+				result.bytes_written += s.bytes_written;
+			}
+			return result;
+		}
+
+	private:
+		struct frame
+		{
+			void* data = nullptr;
+			size_t block_id = 0; // 0 -> the frame holds no block
+			size_t pins = 0;
+			bool dirty = false;
+			bool referenced = false; // CLOCK second-chance bit
+		};
+
+		struct shard_t
+		{
+			mutable std::mutex latch;
+			std::vector<frame> frames;
+			std::unordered_map<size_t, size_t> page_table; // block ID -> index of its frame
+			size_t pool_frames = 0, clock_hand = 0;
+			size_t hits = 0, misses = 0, evictions = 0, writebacks = 0;
+			size_t bytes_read = 0, bytes_written = 0;
+			std::vector<char> io_buffer; // encoded blocks, only used with a codec
+		};
+
+		int file_;
+		size_t slot_size_;
+		std::vector<shard_t> shards_;
+		const block_codec* codec_;
+		id_allocator ids_;
+
+		shard_t& shard(size_t block_id) { return shards_[block_id % shards_.size()]; }
+
+		off_t slot_offset(size_t block_id) const
+		{
+			return static_cast<off_t>((block_id - 1) * slot_size_);
+		}
+
+		// reads size bytes at offset, the part past the end of the file (never written) reads as zeros
+		void read_bytes(void* data, size_t size, off_t offset) const
+		{
+			auto dst = static_cast<char*>(data);
+			size_t done = 0;
+			while (done < size)
+			{
+				ssize_t r = pread(file_, dst + done, size - done, offset + done);
+				if (r < 0 && errno == EINTR) continue;
+				if (r < 0) throw std::system_error(errno, std::generic_category(), "block_provider: pread");
+				if (r == 0)
+				{
+					memset(dst + done, 0, size - done);
+					return;
+				}
+				done += static_cast<size_t>(r);
+			}
+		}
+
+		void write_bytes(const void* data, size_t size, off_t offset) const
+		{
+			auto src = static_cast<const char*>(data);
+			size_t done = 0;
+			while (done < size)
+			{
+				ssize_t w = pwrite(file_, src + done, size - done, offset + done);
+				if (w < 0 && errno == EINTR) continue;
+				if (w < 0) throw std::system_error(errno, std::generic_category(), "block_provider: pwrite");
+				done += static_cast<size_t>(w);
+			}
+		}
+
+		// the shard's latch must be held
+		void read_slot(shard_t& s, size_t block_id, void* data)
+		{
+			if (codec_ == nullptr)
+			{
+				read_bytes(data, slot_size_, slot_offset(block_id));
+				s.bytes_read += slot_size_;
+				return;
+			}
+			// the first page tells the size of the encoded block
+			s.io_buffer.resize(slot_size_);
+			size_t head = slot_size_ < page_size_ ? slot_size_ : page_size_;
+			read_bytes(s.io_buffer.data(), head, slot_offset(block_id));
+			size_t size = codec_->encoded_size(s.io_buffer.data(), slot_size_);
+			if (size > head) read_bytes(s.io_buffer.data() + head, size - head, slot_offset(block_id) + head);
+			codec_->decode(s.io_buffer.data(), size, data, slot_size_);
+			s.bytes_read += size < head ? head : size;
+		}
+
+		// the shard's latch must be held
+		void write_slot(shard_t& s, size_t block_id, const void* data)
+		{
+			if (codec_ == nullptr)
+			{
+				write_bytes(data, slot_size_, slot_offset(block_id));
+				s.bytes_written += slot_size_;
+				return;
+			}
+			s.io_buffer.resize(slot_size_);
+			size_t size = codec_->encode(data, slot_size_, s.io_buffer.data());
+			write_bytes(s.io_buffer.data(), size, slot_offset(block_id));
+			s.bytes_written += size;
+		}
+
+		void add_frame(shard_t& s)
+		{
+			frame f;
+			if (posix_memalign(&f.data, page_size_, slot_size_) != 0) throw std::bad_alloc();
+			s.frames.push_back(f);
+		}
+
+		void evict(shard_t& s, frame& f)
+		{
+			if (f.dirty)
+			{
+				write_slot(s, f.block_id, f.data);
+				++s.writebacks;
+			}
+			s.page_table.erase(f.block_id);
+			++s.evictions;
+			f.block_id = 0;
+			f.dirty = false;
+		}
+
+		// finds a frame for a block that is about to enter the shard, the shard's latch must be held
+		size_t grab_frame(shard_t& s)
+		{
+			if (s.frames.size() < s.pool_frames)
+			{
+				add_frame(s);
+				return s.frames.size() - 1;
+			}
+			// two sweeps are enough to clear every reference bit once
+			for (size_t step = 0; step < 2 * s.frames.size(); ++step)
+			{
+				size_t idx = s.clock_hand;
+				s.clock_hand = (s.clock_hand + 1) % s.frames.size();
+				frame& f = s.frames[idx];
+				if (f.pins != 0) continue;
+				if (f.referenced)
+				{
+					f.referenced = false; // second chance
+					continue;
+				}
+				if (f.block_id != 0) evict(s, f);
+				return idx;
+			}
+			// every frame is pinned
+			add_frame(s);
+			return s.frames.size() - 1;
+		}
+	};
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Search kernels for the sorted payload of a block.
+// Keys are addressed with a byte stride so the same kernels work for interleaved (key, value) records
+// as well as for contiguous key arrays.
+
+namespace isam_impl
+{
+	// number of keys left in the search window at which bisection stops and a linear count takes over
+	template<class TKey>
+	constexpr size_t search_window()
+	{
+		return std::is_arithmetic<TKey>::value ? 16 : 1;
+	}
+
+	template<size_t Stride>
+	inline const char* key_at(const char* keys, size_t i)
+	{
+		return keys + i * Stride;
+	}
+
+	// counts the keys smaller than key among n sorted keys that are Stride bytes apart
+	template<class TKey, size_t Stride>
+	size_t count_less(const TKey* keys, size_t n, const TKey& key)
+	{
+		auto bytes = reinterpret_cast<const char*>(keys);
+		size_t result = 0, i = 0;
+#if defined(__SSE2__)
+		constexpr bool int32_key = std::is_integral<TKey>::value && std::is_signed<TKey>::value && sizeof(TKey) == 4;
+		constexpr bool float_key = std::is_same<TKey, float>::value;
+		constexpr bool int64_key = std::is_integral<TKey>::value && std::is_signed<TKey>::value && sizeof(TKey) == 8;
+		constexpr bool double_key = std::is_same<TKey, double>::value;
+		// keys either fill every lane (contiguous) or every other lane (4+4 or 8+8 byte records)
+		constexpr bool dense = Stride == sizeof(TKey);
+		constexpr bool sparse = Stride == 2 * sizeof(TKey);
+		if constexpr ((int32_key || float_key) && (dense || sparse))
+		{
+			constexpr size_t per_vec = dense ? 4 : 2;
+#if defined(__AVX2__)
+			constexpr size_t per_wide = dense ? 8 : 4;
+			for (; i + per_wide <= n; i += per_wide)
+			{
+				auto p = key_at<Stride>(bytes, i);
+				unsigned mask;
+				if constexpr (int32_key)
+				{
+					__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+					mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(key), v)));
+				}
+				else
+				{
+					__m256 v = _mm256_loadu_ps(reinterpret_cast<const float*>(p));
+					mask = _mm256_movemask_ps(_mm256_cmp_ps(v, _mm256_set1_ps(key), _CMP_LT_OQ));
+				}
+				if constexpr (sparse) mask &= 0x55;
+				result += __builtin_popcount(mask);
+			}
+#endif
+			for (; i + per_vec <= n; i += per_vec)
+			{
+				auto p = key_at<Stride>(bytes, i);
+				unsigned mask;
+				if constexpr (int32_key)
+				{
+					__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+					mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(key), v)));
+				}
+				else
+				{
+					__m128 v = _mm_loadu_ps(reinterpret_cast<const float*>(p));
+					mask = _mm_movemask_ps(_mm_cmplt_ps(v, _mm_set1_ps(key)));
+				}
+				if constexpr (sparse) mask &= 0x5;
+				result += __builtin_popcount(mask);
+			}
+		}
+		else if constexpr ((int64_key || double_key) && dense)
+		{
+#if defined(__AVX2__)
+			for (; i + 4 <= n; i += 4)
+			{
+				auto p = key_at<Stride>(bytes, i);
+				unsigned mask;
+				if constexpr (int64_key)
+				{
+					__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+					mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_set1_epi64x(key), v)));
+				}
+				else
+				{
+					__m256d v = _mm256_loadu_pd(reinterpret_cast<const double*>(p));
+					mask = _mm256_movemask_pd(_mm256_cmp_pd(v, _mm256_set1_pd(key), _CMP_LT_OQ));
+				}
+				result += __builtin_popcount(mask);
+			}
+#endif
+			if constexpr (double_key)
+			{
+				for (; i + 2 <= n; i += 2)
+				{
+					__m128d v = _mm_loadu_pd(reinterpret_cast<const double*>(key_at<Stride>(bytes, i)));
+					result += __builtin_popcount(_mm_movemask_pd(_mm_cmplt_pd(v, _mm_set1_pd(key))));
+				}
+			}
+		}
+#endif
+		for (; i < n; ++i)
+		{
+			result += (*reinterpret_cast<const TKey*>(key_at<Stride>(bytes, i)) < key);
+		}
+		return result;
+	}
+
+	// position of the first of count sorted keys (Stride bytes apart) that is not smaller than key
+	// bisects branchlessly while the window is large, then counts the rest of the window linearly
+	template<class TKey, size_t Stride>
+	size_t lower_bound_keys(const TKey* keys, size_t count, const TKey& key)
+	{
+		if (count == 0) return 0;
+		auto first = reinterpret_cast<const char*>(keys);
+		auto base = first;
+		while (count > search_window<TKey>())
+		{
+			size_t half = count / 2;
+			base = (*reinterpret_cast<const TKey*>(key_at<Stride>(base, half)) < key) ? key_at<Stride>(base, half) : base;
+			count -= half;
+		}
+		size_t offset = static_cast<size_t>(base - first) / Stride;
+		return offset + count_less<TKey, Stride>(reinterpret_cast<const TKey*>(base), count, key);
+	}
+
+	// position of the first record whose key is not smaller than key
+	template<class TKey, class TValue>
+	size_t block_lower_bound(const std::pair<TKey, TValue>* records, size_t count, const TKey& key)
+	{
+		if (count == 0) return 0; // records may be null, e.g. the data() of an empty vector
+		return lower_bound_keys<TKey, sizeof(std::pair<TKey, TValue>)>(&records->first, count, key);
+	}
+}
@@ -0,0 +1,76 @@
+// Micro-benchmark of the in-block search kernels against the former linear scan.
+// Build with e.g. g++ -std=c++17 -O2 -march=native block_search_bench.cpp
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "block_search.hpp"
+
+using namespace std;
+
+// the search formerly used by try_get_value: copies every record until the key is found
+template<class TKey, class TValue>
+size_t linear_search(const pair<TKey, TValue>* records, size_t count, TKey key)
+{
+	pair<TKey, TValue> rec;
+	for (size_t i = 0; i < count; ++i)
+	{
+		rec = records[i];
+		if (!(key < rec.first) && !(rec.first < key)) return i;
+	}
+	return count;
+}
+
+template<class TKey, class TValue>
+size_t binary_search(const pair<TKey, TValue>* records, size_t count, TKey key)
+{
+	size_t lo = 0, hi = count;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (records[mid].first < key) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+template<class F>
+double measure(F f, size_t lookups)
+{
+	auto start = chrono::steady_clock::now();
+	size_t sink = f();
+	auto end = chrono::steady_clock::now();
+	volatile size_t keep = sink; (void)keep;
+	return chrono::duration<double, nano>(end - start).count() / lookups;
+}
+
+template<class TKey, class TValue>
+void run(const char* name, size_t block_size, size_t lookups)
+{
+	vector<pair<TKey, TValue>> block(block_size);
+	for (size_t i = 0; i < block_size; ++i) block[i] = make_pair(static_cast<TKey>(2 * i), TValue());
+
+	mt19937 rng(42);
+	vector<TKey> probes(lookups);
+	for (auto& p : probes) p = static_cast<TKey>(rng() % (2 * block_size)); // half of the probes miss
+
+	size_t linear_lookups = lookups / (block_size / 16); // the linear scan is too slow to run every probe on big blocks
+	double linear = measure([&] { size_t s = 0; for (size_t i = 0; i < linear_lookups; ++i) s += linear_search(block.data(), block_size, probes[i]); return s; }, linear_lookups);
+	double binary = measure([&] { size_t s = 0; for (auto k : probes) s += binary_search(block.data(), block_size, k); return s; }, lookups);
+	double kernel = measure([&] { size_t s = 0; for (auto k : probes) s += isam_impl::block_lower_bound(block.data(), block_size, k); return s; }, lookups);
+
+	cout << name << "," << block_size << "," << linear << "," << binary << "," << kernel << endl;
+}
+
+int main()
+{
+	const size_t lookups = 1 << 20;
+	cout << "key/value,block_size,linear_ns,binary_ns,block_lower_bound_ns" << endl;
+	for (size_t block_size : { 16, 64, 256, 1024, 4096, 16384 })
+	{
+		run<int, int>("int/int", block_size, lookups);
+		run<float, int>("float/int", block_size, lookups);
+		run<long long, long long>("int64/int64", block_size, lookups);
+	}
+	return 0;
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include "block_provider.hpp"
+#include "isam.hpp"
+
+namespace isam_impl
+{
+	// appends the low width bits of value to the bit stream out (zeroed beforehand), bit_pos counts the bits written
+	inline void put_bits(unsigned char* out, size_t& bit_pos, uint64_t value, unsigned width)
+	{
+		while (width > 0)
+		{
+			unsigned shift = bit_pos % 8;
+			unsigned take = 8 - shift < width ? 8 - shift : width;
+			out[bit_pos / 8] |= static_cast<unsigned char>((value & ((1u << take) - 1)) << shift);
+			value >>= take; width -= take; bit_pos += take;
+		}
+	}
+
+	inline uint64_t get_bits(const unsigned char* in, size_t& bit_pos, unsigned width)
+	{
+		uint64_t value = 0;
+		for (unsigned done = 0; done < width; )
+		{
+			unsigned shift = bit_pos % 8;
+			unsigned take = 8 - shift < width - done ? 8 - shift : width - done;
+			value |= static_cast<uint64_t>((in[bit_pos / 8] >> shift) & ((1u << take) - 1)) << done;
+			done += take; bit_pos += take;
+		}
+		return value;
+	}
+
+	// Block codec for file_provider that compresses the keys of isam blocks with integral keys: the first key is
+	// stored in full, the others as deltas to their predecessor, bit-packed with the width of the largest delta
+	// (frame of reference). Values are stored unchanged. Blocks are decoded into the usual layout when they are
+	// read, so search and iteration work as before while the data file sees only the encoded bytes.
+	// Encoded block:
+	// 1x 8b - encoded_tag | encoded size
+	// 2x 8b - count, ID of next block (the block header)
+	// 1x sizeof(TKey) - first key
+	// 1x 1b - delta width in bits
+	// (count - 1) x width bits - deltas, then count x sizeof(TValue) - values
+	// Blocks that would not shrink are stored as they are, their first word (the count) never has the tag set.
+	template<class TKey, class TValue, class TLayout = aos_layout>
+	class delta_codec : public block_provider::block_codec
+	{
+		static_assert(std::is_integral<TKey>::value, "delta_codec: keys must be integral");
+		static_assert(std::is_trivially_copyable<TValue>::value, "delta_codec: values must be trivially copyable");
+
+	public:
+		typedef typename TLayout::template block_view<TKey, TValue> block_view;
+		typedef typename std::make_unsigned<TKey>::type unsigned_key;
+
+		static const uint64_t encoded_tag = uint64_t(1) << 63;
+
+		// capacity: records per block of the isam whose blocks are encoded
+		explicit delta_codec(size_t capacity) : _capacity(capacity) {}
+
+		size_t encode(const void* block, size_t block_size, void* out) const override
+		{
+			block_view view(const_cast<void*>(block), _capacity);
+			size_t count = view.count();
+			unsigned_key max_delta = 0;
+			for (size_t i = 1; i < count; ++i)
+			{
+				unsigned_key delta = static_cast<unsigned_key>(view.key(i)) - static_cast<unsigned_key>(view.key(i - 1));
+				if (delta > max_delta) max_delta = delta;
+			}
+			unsigned width = 0;
+			for (; max_delta != 0; max_delta >>= 1) ++width;
+
+			size_t packed = count == 0 ? 0 : ((count - 1) * width + 7) / 8;
+			size_t size = header_size + packed + count * sizeof(TValue);
+			if (size >= block_size) // nothing to gain
+			{
+				std::memcpy(out, block, block_size);
+				return block_size;
+			}
+
+			auto bytes = static_cast<unsigned char*>(out);
+			uint64_t tag = encoded_tag | size;
+			std::memcpy(bytes, &tag, 8);
+			std::memcpy(bytes + 8, block, 16);
+			TKey first = count == 0 ? TKey() : view.key(0);
+			std::memcpy(bytes + 24, &first, sizeof(TKey));
+			bytes[24 + sizeof(TKey)] = static_cast<unsigned char>(width);
+
+			unsigned char* deltas = bytes + header_size;
+			std::memset(deltas, 0, packed);
+			size_t bit_pos = 0;
+			for (size_t i = 1; i < count; ++i)
+			{
+				put_bits(deltas, bit_pos, static_cast<unsigned_key>(view.key(i)) - static_cast<unsigned_key>(view.key(i - 1)), width);
+			}
+			unsigned char* values = deltas + packed;
+			for (size_t i = 0; i < count; ++i) std::memcpy(values + i * sizeof(TValue), &view.value(i), sizeof(TValue));
+			return size;
+		}
+
+		size_t encoded_size(const void* head, size_t block_size) const override
+		{
+			uint64_t tag;
+			std::memcpy(&tag, head, 8);
+			return (tag & encoded_tag) != 0 ? static_cast<size_t>(tag & ~encoded_tag) : block_size;
+		}
+
+		void decode(const void* in, size_t size, void* block, size_t block_size) const override
+		{
+			uint64_t tag;
+			std::memcpy(&tag, in, 8);
+			if ((tag & encoded_tag) == 0) // stored as it is
+			{
+				std::memcpy(block, in, size);
+				return;
+			}
+
+			auto bytes = static_cast<const unsigned char*>(in);
+			std::memset(block, 0, block_size);
+			std::memcpy(block, bytes + 8, 16);
+			block_view view(block, _capacity);
+			size_t count = view.count();
+			TKey key;
+			std::memcpy(&key, bytes + 24, sizeof(TKey));
+			unsigned width = bytes[24 + sizeof(TKey)];
+
+			const unsigned char* deltas = bytes + header_size;
+			const unsigned char* values = deltas + (count == 0 ? 0 : ((count - 1) * width + 7) / 8);
+			size_t bit_pos = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (i != 0) key = static_cast<TKey>(static_cast<unsigned_key>(key) + static_cast<unsigned_key>(get_bits(deltas, bit_pos, width)));
+				std::memcpy(&view.emplace(i, key), values + i * sizeof(TValue), sizeof(TValue));
+			}
+		}
+
+	private:
+		static const size_t header_size = 24 + sizeof(TKey) + 1;
+
+		size_t _capacity;
+	};
+}
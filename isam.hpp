@@ -2,9 +2,32 @@
 #ifndef ISAM_HPP
 #define ISAM_HPP
 
-#include <map>
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <pthread.h>
 #include "block_provider.hpp"
+#include "block_search.hpp"
+#include "isam_stats.hpp"
+#include "key_filter.hpp"
+#include "static_index.hpp"
+#include "write_ahead_log.hpp"
 
 
 namespace isam_impl
@@ -21,16 +44,96 @@ namespace isam_impl
 	// Structure of block in memory:
 	// 1x 8b - count of items currently in the block
 	// 1x 8b - ID of next block
-	// capacity x sizeof(TKey, TValue) - payload
+	// padding up to the alignment of TKey and TValue
+	// payload, laid out by the isam's layout (see aos_layout and soa_layout)
+
+	const size_t block_header_size = 2 * sizeof(size_t);
+
+	// offset of the payload from the start of the block
+	template<class TKey, class TValue>
+	constexpr size_t payload_offset()
+	{
+		size_t align = alignof(TKey) > alignof(TValue) ? alignof(TKey) : alignof(TValue);
+		return (block_header_size + align - 1) / align * align;
+	}
+
+	// returns the first record of the block's payload
+	template<class TKey, class TValue>
+	std::pair<TKey, TValue>* payload(void* block)
+	{
+		return reinterpret_cast<std::pair<TKey, TValue>*>(static_cast<char*>(block) + payload_offset<TKey, TValue>());
+	}
+
+	// records that can be moved around with memmove
+	template<class TKey, class TValue>
+	constexpr bool trivial_records()
+	{
+		return std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value;
+	}
+
+	// Reader-writer latch that prefers writers: once a writer waits, new readers queue up behind it, so that the
+	// writer makes progress under a steady read load (std::shared_mutex prefers readers on glibc and lets them
+	// starve it). Taken with std::unique_lock or shared_guard. Shared acquisitions must not nest.
+	class shared_latch
+	{
+	public:
+		shared_latch()
+		{
+			pthread_rwlockattr_t attributes;
+			pthread_rwlockattr_init(&attributes);
+#ifdef __GLIBC__
+			pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+			if (pthread_rwlock_init(&_lock, &attributes) != 0) throw std::runtime_error("shared_latch: pthread_rwlock_init");
+			pthread_rwlockattr_destroy(&attributes);
+		}
+
+		shared_latch(const shared_latch&) = delete;
+		shared_latch& operator=(const shared_latch&) = delete;
+
+		~shared_latch() { pthread_rwlock_destroy(&_lock); }
+
+		void lock() { pthread_rwlock_wrlock(&_lock); }
+		bool try_lock() { return pthread_rwlock_trywrlock(&_lock) == 0; }
+		void unlock() { pthread_rwlock_unlock(&_lock); }
+
+		void lock_shared() { pthread_rwlock_rdlock(&_lock); }
+		bool try_lock_shared() { return pthread_rwlock_tryrdlock(&_lock) == 0; }
+		void unlock_shared() { pthread_rwlock_unlock(&_lock); }
+
+	private:
+		pthread_rwlock_t _lock;
+	};
+
+	// holds a shared_latch in shared mode for its scope
+	class shared_guard
+	{
+	public:
+		explicit shared_guard(shared_latch& latch) : _latch(latch) { _latch.lock_shared(); }
+		~shared_guard() { _latch.unlock_shared(); }
+
+		shared_guard(const shared_guard&) = delete;
+		shared_guard& operator=(const shared_guard&) = delete;
+
+	private:
+		shared_latch& _latch;
+	};
 
 	template<class TKey, class TValue>
 	struct isam_block
 	{
 	public:
-		size_t count;
-		void* block;
-		size_t next;
+		size_t count = 0;
+		void* block = nullptr;
+		size_t next = 0;
 		size_t idx;
+		block_provider::provider* provider;
+
+		// writes the (modified) block back into its provider
+		void store()
+		{
+			if (idx != 0) provider->store_block(idx);
+		}
 
 		void set_next(size_t n)
 		{
@@ -40,205 +143,720 @@ namespace isam_impl
 			next = n;
 		}
 
-		isam_block(size_t block_idx) : idx(block_idx) // Block stored in provider
+		isam_block(block_provider::provider* block_source, size_t block_idx) : idx(block_idx), provider(block_source) // Block stored in provider
 		{
 			if (block_idx == 0) return;
-			block = block_provider::load_block(block_idx);
+			block = provider->load_block(block_idx);
 			auto bptr = reinterpret_cast<size_t*>(block);
 			count = *bptr; ++bptr;
 			next = *bptr;
 		}
 	};
 
-	template<class TKey, class TValue>
-	TValue& put_record(std::pair<TKey, TValue>* p, TKey key)
+	// writes key into the unused slot p and constructs its value in place from args
+	template<class TKey, class TValue, class... TArgs>
+	TValue& put_record(std::pair<TKey, TValue>* p, const TKey& key, TArgs&&... args)
 	{
-		auto key_p = reinterpret_cast<TKey*>(p);
-		*key_p = key;
-		++key_p;
-		auto val_p = reinterpret_cast<TValue*>(key_p);
-		new (val_p) TValue(); // in-place construction
+		p->first = key;
+		auto val_p = &(p->second); // respects the padding between key and value
+		new (val_p) TValue(std::forward<TArgs>(args)...); // in-place construction
 		return *val_p;
 	}
 
 	// starting at p, moves count records to the right by one
+	// the slot behind them must be unused, the slot at p is left holding a moved-from record
 	template<class TKey, class TValue>
 	void shift(std::pair<TKey, TValue>* p, size_t count)
 	{
-		std::pair<TKey, TValue> last, next;
-		last = *p; ++p;
-		for (size_t i = 0; i < count; ++i)
+		if constexpr (trivial_records<TKey, TValue>())
 		{
-			next = *p;
-			//*p = last;
-			put_record<TKey, TValue>(p, last.first) = last.second;
-			last = next;
-			++p;
+			std::memmove(static_cast<void*>(p + 1), static_cast<const void*>(p), count * sizeof(std::pair<TKey, TValue>));
+			return;
 		}
+		put_record(p + count, p[count - 1].first, std::move(p[count - 1].second));
+		std::move_backward(p, p + count - 1, p + count);
 	}
 
-	template<class TKey, class TValue>
-	TValue& insert(void* block, TKey key)
+	// moved_bytes receives the number of bytes shifted to make room for the record
+	template<class TKey, class TValue, class... TArgs>
+	TValue& insert(void* block, const TKey& key, size_t& moved_bytes, TArgs&&... args)
 	{
 		auto stp = reinterpret_cast<size_t*>(block);
 		size_t count = *stp;
 		++(*stp); // increase count of items in this block
-		stp += 2; // skip block header
-		size_t new_elem_pos = 0;
-		auto payload_ptr = reinterpret_cast<std::pair<TKey, TValue>*>(stp);
-		auto data_start = payload_ptr;
-		std::pair<TKey, TValue> rec = *payload_ptr;
+		auto payload_ptr = payload<TKey, TValue>(block);
 
-		// block is empty -> insert at first positon
-		if (count == 0)
+		// keys are unique, so the lower bound is the insertion point
+		size_t new_elem_pos = block_lower_bound(payload_ptr, count, key);
+		auto data_start = payload_ptr + new_elem_pos;
+		moved_bytes = (count - new_elem_pos) * sizeof(std::pair<TKey, TValue>);
+		if (new_elem_pos < count)
 		{
-			return put_record(payload_ptr, key);
+			shift<TKey, TValue>(data_start, count - new_elem_pos); // move other elements to make space for the new one
+			if constexpr (!trivial_records<TKey, TValue>()) data_start->second.~TValue(); // moved-from, the new value is constructed below
 		}
+		return put_record(data_start, key, std::forward<TArgs>(args)...);
+	}
+
+	// record handed out by iterators over blocks that do not store std::pair records
+	// it also serves as its own pointer type, so that it->first works
+	template<class TKey, class TValue>
+	struct record_ref
+	{
+		const TKey& first;
+		TValue& second;
+
+		const record_ref* operator->() const { return this; }
+	};
 
-		// new item belongs to the front
-		if (key < rec.first) new_elem_pos = 0;
+	// Block layouts, chosen per isam instantiation. A layout provides block_view<TKey, TValue>, which addresses
+	// the records of one block of a given capacity:
+	// payload_bytes(capacity) - size of the payload
+	// count(), set_count(n) - the count in the block header
+	// key(i), value(i), record(i) - the i-th record (record() returns reference, usable through pointer)
+	// lower_bound(count, key) - position of the first of count records whose key is not smaller than key
+	// Slots below the count hold records, the others are unused memory, and records are moved, never copied:
+	// emplace(i, key, args...) - writes key into the unused slot i and constructs its value from args, returns the value
+	// assign(i, key, value) - overwrites the record at i, moving value in
+	// destroy(first, last) - ends the lifetime of the values [first, last), the count is left to the caller
+	// insert(key, moved_bytes, args...) - emplaces a record at its sorted position and increments the count
+	// erase(first, last) - removes the records [first, last) and decrements the count
+	// make_ref(pair) - reference to a record kept outside of blocks (the overflow area)
 
-		// new item belongs between two other items
-		for (size_t i = 0; i < count - 1; ++i)
+	// array of std::pair<TKey, TValue> records (the default)
+	struct aos_layout
+	{
+		template<class TKey, class TValue>
+		class block_view
 		{
-			if ((*payload_ptr).first < key && key < (*(payload_ptr + 1)).first)
+		public:
+			typedef std::pair<TKey, TValue>& reference;
+			typedef std::pair<TKey, TValue>* pointer;
+
+			block_view(void* block, size_t) : _block(block) {}
+
+			static constexpr size_t payload_bytes(size_t capacity) { return capacity * sizeof(std::pair<TKey, TValue>); }
+
+			size_t count() const { return *reinterpret_cast<size_t*>(_block); }
+			void set_count(size_t count) const { *reinterpret_cast<size_t*>(_block) = count; }
+
+			const TKey& key(size_t i) const { return records()[i].first; }
+			TValue& value(size_t i) const { return records()[i].second; }
+			reference record(size_t i) const { return records()[i]; }
+
+			size_t lower_bound(size_t count, const TKey& key) const { return block_lower_bound(records(), count, key); }
+
+			template<class... TArgs>
+			TValue& emplace(size_t i, const TKey& key, TArgs&&... args) const
 			{
-				new_elem_pos = i + 1;
-				break;
+				return put_record(records() + i, key, std::forward<TArgs>(args)...);
+			}
+
+			void assign(size_t i, const TKey& key, TValue&& value) const
+			{
+				records()[i].first = key;
+				records()[i].second = std::move(value);
+			}
+
+			void destroy(size_t first, size_t last) const
+			{
+				if constexpr (!std::is_trivially_destructible<TValue>::value)
+				{
+					for (size_t i = first; i < last; ++i) records()[i].second.~TValue();
+				}
+			}
+
+			template<class... TArgs>
+			TValue& insert(const TKey& key, size_t& moved_bytes, TArgs&&... args) const
+			{
+				return isam_impl::insert<TKey, TValue>(_block, key, moved_bytes, std::forward<TArgs>(args)...);
+			}
+
+			void erase(size_t first, size_t last) const
+			{
+				if (first == last) return;
+				size_t count = this->count();
+				auto records = this->records();
+				if constexpr (trivial_records<TKey, TValue>())
+				{
+					std::memmove(static_cast<void*>(records + first), static_cast<const void*>(records + last), (count - last) * sizeof(std::pair<TKey, TValue>));
+				}
+				else
+				{
+					std::move(records + last, records + count, records + first);
+					destroy(count - (last - first), count);
+				}
+				set_count(count - (last - first));
+			}
+
+			static reference make_ref(std::pair<TKey, TValue>& record) { return record; }
+			static pointer address(reference record) { return &record; }
+
+		private:
+			void* _block;
+
+			std::pair<TKey, TValue>* records() const { return payload<TKey, TValue>(_block); }
+		};
+	};
+
+	// all keys of the block in one array, followed by all values in another
+	// a search only reads key cache lines (and uses the dense SIMD kernels), whatever the size of TValue
+	struct soa_layout
+	{
+		template<class TKey, class TValue>
+		class block_view
+		{
+		public:
+			typedef record_ref<TKey, TValue> reference;
+			typedef record_ref<TKey, TValue> pointer;
+
+			block_view(void* block, size_t capacity) : _block(block)
+			{
+				if (block == nullptr) return;
+				auto payload_ptr = static_cast<char*>(block) + payload_offset<TKey, TValue>();
+				_keys = reinterpret_cast<TKey*>(payload_ptr);
+				_values = reinterpret_cast<TValue*>(payload_ptr + values_offset(capacity));
+			}
+
+			static constexpr size_t payload_bytes(size_t capacity) { return values_offset(capacity) + capacity * sizeof(TValue); }
+
+			size_t count() const { return *reinterpret_cast<size_t*>(_block); }
+			void set_count(size_t count) const { *reinterpret_cast<size_t*>(_block) = count; }
+
+			const TKey& key(size_t i) const { return _keys[i]; }
+			TValue& value(size_t i) const { return _values[i]; }
+			reference record(size_t i) const { return reference{ _keys[i], _values[i] }; }
+
+			size_t lower_bound(size_t count, const TKey& key) const { return lower_bound_keys<TKey, sizeof(TKey)>(_keys, count, key); }
+
+			template<class... TArgs>
+			TValue& emplace(size_t i, const TKey& key, TArgs&&... args) const
+			{
+				_keys[i] = key;
+				new (_values + i) TValue(std::forward<TArgs>(args)...); // in-place construction
+				return _values[i];
+			}
+
+			void assign(size_t i, const TKey& key, TValue&& value) const
+			{
+				_keys[i] = key;
+				_values[i] = std::move(value);
+			}
+
+			void destroy(size_t first, size_t last) const
+			{
+				if constexpr (!std::is_trivially_destructible<TValue>::value)
+				{
+					for (size_t i = first; i < last; ++i) _values[i].~TValue();
+				}
 			}
-			++payload_ptr;
-		}
 
-		// new item belongs at the end
-		if (new_elem_pos == 0 && (*payload_ptr).first < key) new_elem_pos = count;
+			template<class... TArgs>
+			TValue& insert(const TKey& key, size_t& moved_bytes, TArgs&&... args) const
+			{
+				size_t count = this->count();
+				set_count(count + 1);
+				size_t pos = lower_bound(count, key);
+				moved_bytes = (count - pos) * (sizeof(TKey) + sizeof(TValue));
+				if constexpr (trivial_records<TKey, TValue>())
+				{
+					std::memmove(static_cast<void*>(_keys + pos + 1), static_cast<const void*>(_keys + pos), (count - pos) * sizeof(TKey));
+					std::memmove(static_cast<void*>(_values + pos + 1), static_cast<const void*>(_values + pos), (count - pos) * sizeof(TValue));
+				}
+				else if (pos < count) // make space for the new record
+				{
+					emplace(count, _keys[count - 1], std::move(_values[count - 1]));
+					std::move_backward(_keys + pos, _keys + count - 1, _keys + count);
+					std::move_backward(_values + pos, _values + count - 1, _values + count);
+					destroy(pos, pos + 1);
+				}
+				return emplace(pos, key, std::forward<TArgs>(args)...);
+			}
+
+			void erase(size_t first, size_t last) const
+			{
+				if (first == last) return;
+				size_t count = this->count();
+				if constexpr (trivial_records<TKey, TValue>())
+				{
+					std::memmove(static_cast<void*>(_keys + first), static_cast<const void*>(_keys + last), (count - last) * sizeof(TKey));
+					std::memmove(static_cast<void*>(_values + first), static_cast<const void*>(_values + last), (count - last) * sizeof(TValue));
+				}
+				else
+				{
+					std::move(_keys + last, _keys + count, _keys + first);
+					std::move(_values + last, _values + count, _values + first);
+					destroy(count - (last - first), count);
+				}
+				set_count(count - (last - first));
+			}
+
+			static reference make_ref(std::pair<TKey, TValue>& record) { return reference{ record.first, record.second }; }
+			static pointer address(reference record) { return record; }
+
+		private:
+			void* _block;
+			TKey* _keys = nullptr;
+			TValue* _values = nullptr;
 
-		data_start += new_elem_pos;
-		shift<TKey, TValue>(data_start, count - new_elem_pos); // move other elements to make space for the new one
-		return put_record(data_start, key);
+			// the value array starts after the key array, aligned for TValue
+			static constexpr size_t values_offset(size_t capacity)
+			{
+				return (capacity * sizeof(TKey) + alignof(TValue) - 1) / alignof(TValue) * alignof(TValue);
+			}
+		};
+	};
+
+	// bytes of a block holding capacity records
+	template<class TKey, class TValue, class TLayout>
+	constexpr size_t block_bytes(size_t capacity)
+	{
+		return payload_offset<TKey, TValue>() + TLayout::template block_view<TKey, TValue>::payload_bytes(capacity);
+	}
+
+	// largest capacity whose blocks fit into the given number of pages, for sizing static_isam blocks
+	template<class TKey, class TValue, class TLayout = aos_layout>
+	constexpr size_t page_capacity(size_t pages = 1)
+	{
+		size_t bytes = pages * block_provider::page_size_;
+		size_t capacity = (bytes - payload_offset<TKey, TValue>()) / (sizeof(TKey) + sizeof(TValue));
+		while (capacity > 0 && block_bytes<TKey, TValue, TLayout>(capacity) > bytes) --capacity;
+		return capacity;
 	}
 
-	// splits the elements from the first block between itself and the second one (empty), including a new element with key, returning a reference to the new elem's value
+	// replaces the records of the block with count records moved from records and stores the new count in its header
+	template<class TView, class TKey, class TValue>
+	void write_records(const TView& view, std::pair<TKey, TValue>* records, size_t count)
+	{
+		view.destroy(0, view.count());
+		for (size_t i = 0; i < count; ++i)
+		{
+			view.emplace(i, records[i].first, std::move(records[i].second));
+		}
+		view.set_count(count);
+	}
+
+	// overflow area: records sorted by key in one contiguous array
+	// storage for the whole capacity is allocated up front, so inserts never allocate and probes are binary searches
 	template<class TKey, class TValue>
-	TValue& split(void* fst, void* snd, TKey key)
+	class oflow_area
 	{
-		auto fst_p = reinterpret_cast<size_t*>(fst); auto snd_p = reinterpret_cast<size_t*>(snd);
-		size_t count_fst = *fst_p; fst_p += 2; snd_p += 2;
-		auto fst_payload = reinterpret_cast<std::pair<TKey, TValue>*>(fst_p);
-		auto snd_payload = reinterpret_cast<std::pair<TKey, TValue>*>(snd_p);
-		fst_payload += ((count_fst / 2) + (count_fst % 2) - 1);
-		size_t copy_start_index; bool new_elem_left;
-		if (key < (*fst_payload).first) // copy the "middle" element as well because the new one is going on the left
+	public:
+		typedef std::pair<TKey, TValue>* iterator;
+
+		explicit oflow_area(size_t capacity)
 		{
-			copy_start_index = (count_fst / 2) + (count_fst % 2) - 1;
-			new_elem_left = true;
+			_records.reserve(capacity == 0 ? 1 : capacity);
 		}
-		else // leave the "middle" element because the new one is going on the right
+
+		// returns the record with the given key or nullptr
+		std::pair<TKey, TValue>* find(const TKey& key)
 		{
-			copy_start_index = (count_fst / 2) + (count_fst % 2);
-			new_elem_left = false;
-			++fst_payload;
+			size_t pos = block_lower_bound(_records.data(), _records.size(), key);
+			if (pos == _records.size() || key < _records[pos].first) return nullptr;
+			return &_records[pos];
 		}
 
-		// copy the appropriate amount of elements from left to right
-		size_t right_count = 0;
-		for (size_t i = copy_start_index; i < count_fst; ++i)
+		const std::pair<TKey, TValue>* find(const TKey& key) const
 		{
-			//*snd_payload = *fst_payload;
-			put_record<TKey, TValue>(snd_payload, fst_payload->first) = fst_payload->second;
-			++right_count;
-			++snd_payload; ++fst_payload;
+			size_t pos = block_lower_bound(_records.data(), _records.size(), key);
+			if (pos == _records.size() || key < _records[pos].first) return nullptr;
+			return &_records[pos];
 		}
-		*(reinterpret_cast<size_t*>(fst)) -= right_count;
-		*(reinterpret_cast<size_t*>(snd)) = right_count;
 
-		// insert the new element into the right block
-		void* new_elem_block;
-		if (new_elem_left) new_elem_block = fst;
-		else new_elem_block = snd;
+		// inserts a record for a key that is not present yet, its value constructed from args
+		template<class... TArgs>
+		TValue& emplace(const TKey& key, TArgs&&... args)
+		{
+			size_t pos = block_lower_bound(_records.data(), _records.size(), key);
+			return _records.emplace(_records.begin() + pos, std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<TArgs>(args)...))->second;
+		}
 
-		return insert<TKey, TValue>(new_elem_block, key);
-	}
+		// removes the records with keys in [lo, hi), returns their number
+		size_t erase(const TKey& lo, const TKey& hi)
+		{
+			size_t first = block_lower_bound(_records.data(), _records.size(), lo);
+			size_t last = block_lower_bound(_records.data(), _records.size(), hi);
+			if (last <= first) return 0;
+			_records.erase(_records.begin() + first, _records.begin() + last);
+			return last - first;
+		}
 
-	// get maximum key from the given non-empty block
-	template<class TKey, class TValue>
-	TKey get_max(void* block)
-	{
-		auto stp = reinterpret_cast<size_t*>(block);
-		size_t count = *stp;
-		stp += 2;
-		auto payload_ptr = reinterpret_cast<std::pair<TKey, TValue>*>(stp);
-		payload_ptr += (count - 1);
-		return (*payload_ptr).first;
-	}
+		bool erase(const TKey& key)
+		{
+			auto rec = find(key);
+			if (rec == nullptr) return false;
+			_records.erase(_records.begin() + (rec - _records.data()));
+			return true;
+		}
 
-	template<class TKey, class TValue>
-	std::pair<TKey, TValue>* to_pair_ptr(typename std::set<std::pair<TKey, TValue>, isam_impl::ComparePairFst<TKey, TValue>>::iterator it)
-	{
-		return const_cast<std::pair<TKey, TValue>*>(&(*it));
-	}
+		iterator begin() { return _records.data(); }
+		iterator end() { return _records.data() + _records.size(); }
+		const std::pair<TKey, TValue>* begin() const { return _records.data(); }
+		const std::pair<TKey, TValue>* end() const { return _records.data() + _records.size(); }
+		size_t size() const { return _records.size(); }
+
+		// drops all records at once, the storage is kept for the next round
+		void clear() { _records.clear(); }
+
+	private:
+		std::vector<std::pair<TKey, TValue>> _records;
+	};
 }
 
 // TKey: simple value type, no duplicates, comparable: operator<
 // TValue: default constructible, assume reasonable usage
-template <class TKey, class TValue>
+// TLayout: isam_impl::aos_layout (records) or isam_impl::soa_layout (key array + value array), see block_view
+// BlockCapacity: records per block fixed at compile time (see static_isam), 0 -> given to the constructor
+template <class TKey, class TValue, class TLayout = isam_impl::aos_layout, size_t BlockCapacity = 0>
 class isam
 {
+	typedef typename TLayout::template block_view<TKey, TValue> block_view;
+
 public:
 	TValue & operator[](TKey key)
 	{
-		// find appropriate block in the primary file using the index
-		auto block = _index.lower_bound(key);
+		if (_log) _log_pending.push_back(key); // the value is assigned after we return, see commit()
+		return *upsert(key, false).first;
+	}
 
-		// in case the key exists in the container, returns the value
-		// check overflow space first
-		auto oflow_result = _oflow.find(std::pair<TKey, TValue>(key, TValue())); // !!!
-		if (oflow_result != _oflow.end())
+	// inserts the record or overwrites the value of an existing one, while holding the latch that guards the value
+	// unlike assigning through operator[], this is safe while other threads read the key through get()
+	void insert_or_assign(const TKey& key, const TValue& value)
+	{
+		upsert(key, true, value);
+		if (_log) log_record(log_assign, key, &value, sizeof(TValue));
+	}
+
+	void insert_or_assign(const TKey& key, TValue&& value)
+	{
+		TValue& result = *upsert(key, true, std::move(value)).first;
+		if (_log) log_record(log_assign, key, &result, sizeof(TValue));
+	}
+
+	// inserts a record whose value is constructed in place (in its block or overflow slot) from args, unless key is
+	// present already, returns the value of key and whether it was inserted
+	// new values are latched like insert_or_assign, a value written through the result afterwards is not
+	template<class... TArgs>
+	std::pair<TValue*, bool> try_emplace(const TKey& key, TArgs&&... args)
+	{
+		auto result = upsert(key, false, std::forward<TArgs>(args)...);
+		if (_log && result.second) log_record(log_assign, key, result.first, sizeof(TValue));
+		return result;
+	}
+
+	// same as try_emplace, keys are unique
+	template<class... TArgs>
+	std::pair<TValue*, bool> emplace(const TKey& key, TArgs&&... args)
+	{
+		return try_emplace(key, std::forward<TArgs>(args)...);
+	}
+
+	// Concurrent lookup: copies the value of key into out, returns false if the key is not present.
+	// Any number of threads may call get() while a single writer thread uses the rest of the interface. Readers
+	// hold the structure latch shared (push_oflow takes it exclusively), the overflow latch shared while probing
+	// the overflow, and the latch of the one block they search. They never touch the writer's current block.
+	// Values written through references (operator[], iterators) are not latched, use insert_or_assign instead.
+	bool get(const TKey& key, TValue& out) const
+	{
+		return probe(key, [&out](const TValue& value) { out = value; });
+	}
+
+	// Lookups that never insert: they read _index, the overflow and at most one block, and write nothing back.
+	// contains() and at() follow the same latching as get() and may run concurrently with the writer.
+	bool contains(const TKey& key) const
+	{
+		return probe(key, [](const TValue&) {});
+	}
+
+	// returns a copy of the value of key, throws std::out_of_range if the key is not present
+	TValue at(const TKey& key) const
+	{
+		TValue result;
+		if (!get(key, result)) throw std::out_of_range("isam::at: key not present");
+		return result;
+	}
+
+	// Batch lookup: out[i] receives the value of keys[i], or stays empty if the key is not present, returns the
+	// number of keys found. The keys are sorted, the overflow is searched in one merge pass, and the keys are
+	// grouped by their block through _index, so that every block is loaded once and all of its keys are resolved
+	// together. With threads > 1 the groups are split among that many threads. Latches as get(), so it may run
+	// concurrently with the writer.
+	size_t multi_get(const std::vector<TKey>& keys, std::vector<std::optional<TValue>>& out, size_t threads = 1) const
+	{
+		out.assign(keys.size(), std::nullopt);
+		std::vector<size_t> order(keys.size());
+		std::iota(order.begin(), order.end(), size_t(0));
+		std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+		isam_impl::shared_guard structure(_latch);
+		size_t found = 0;
 		{
-			const TValue& ref = (*oflow_result).second;
-			return const_cast<TValue&>(ref); // val is not used for sorting -> const_cast will not break the set
+			isam_impl::shared_guard oflow(_oflow_latch);
+			auto rec = _oflow.begin();
+			for (size_t i : order)
+			{
+				while (rec != _oflow.end() && rec->first < keys[i]) ++rec;
+				if (rec == _oflow.end()) break;
+				if (!(keys[i] < rec->first))
+				{
+					out[i] = rec->second;
+					++found;
+				}
+			}
 		}
+		_counters.oflow_hits.add(found);
+		_counters.oflow_misses.add(keys.size() - found);
 
-		if (block != _index.end()) // FIXME: inserting key that is larger than all existing ones
+		// runs of order whose keys fall into the same block: index position, first, last
+		std::vector<std::array<size_t, 3>> groups;
+		for (size_t first = 0; first < order.size(); )
 		{
-			load_block((*block).second);
-			auto result = try_get_value(key);
-			if (result != nullptr) return *result;
+			size_t block = _index.lower_bound(keys[order[first]]);
+			if (block == _index.size()) break; // above every maximum, and so are the following keys
+			size_t last = first + 1;
+			while (last < order.size() && !(_index.key(block) < keys[order[last]])) ++last;
+			groups.push_back({ block, first, last });
+			first = last;
+		}
 
-			// in case the key does not exist in the container
-			// if the block is not full insert new record to the block with default value
-			if (_current_block.count < _block_size)
+		if (threads <= 1 || groups.size() < 2)
+		{
+			for (auto& group : groups) found += resolve_group(group, order, keys, out);
+			return found;
+		}
+		if (threads > groups.size()) threads = groups.size();
+		std::vector<size_t> counts(threads, 0);
+		std::vector<std::exception_ptr> errors(threads);
+		std::vector<std::thread> workers;
+		for (size_t t = 0; t < threads; ++t)
+		{
+			workers.emplace_back([&, t]()
+			{
+				try
+				{
+					for (size_t g = groups.size() * t / threads; g < groups.size() * (t + 1) / threads; ++g)
+					{
+						counts[t] += resolve_group(groups[g], order, keys, out);
+					}
+				}
+				catch (...)
+				{
+					errors[t] = std::current_exception();
+				}
+			});
+		}
+		for (auto& worker : workers) worker.join();
+		for (auto& error : errors)
+		{
+			if (error) std::rethrow_exception(error);
+		}
+		return found + std::accumulate(counts.begin(), counts.end(), size_t(0));
+	}
+
+	// Batch insert_or_assign of (key, value) records given in any order. They are applied in key order, so the
+	// records of one block are inserted into the writer's current block one after another, without switching
+	// blocks in between. Of records with the same key, the last one wins.
+	template<class TIter>
+	void multi_upsert(TIter first, TIter last)
+	{
+		std::vector<TIter> order;
+		for (; first != last; ++first) order.push_back(first);
+		std::stable_sort(order.begin(), order.end(), [](const TIter& a, const TIter& b) { return (*a).first < (*b).first; });
+		for (auto& rec : order) insert_or_assign((*rec).first, (*rec).second);
+	}
+
+	// Removes key, returns the number of removed records (0 or 1).
+	// A block left with less than a quarter of its capacity is merged with a neighbour, or takes records over from
+	// it when both do not fit into one block. Freed blocks are returned to the provider. Iterators are invalidated.
+	size_t erase(const TKey& key)
+	{
+		uint64_t hash = _filter_bits != 0 ? isam_impl::key_hash(key) : 0;
+		if ((_filter_bits == 0 || _oflow_filter.may_contain(hash)) && _oflow.find(key) != nullptr)
+		{
+			std::unique_lock<isam_impl::shared_latch> latch(_oflow_latch);
+			_oflow.erase(key);
+			--_oflow_count;
+			if (_log) log_record(log_erase, key, nullptr, 0);
+			return 1;
+		}
+
+		size_t block = _index.lower_bound(key);
+		if (block == _index.size() || filter_excludes(_index.id(block), hash)) return 0;
+		load_block(_index.id(block));
+		block_view view(_current_block.block, capacity());
+		size_t pos = view.lower_bound(_current_block.count, key);
+		if (pos == _current_block.count || key < view.key(pos)) return 0;
+		if (shared(_current_block.idx))
+		{
+			own_current_block(block);
+			view = block_view(_current_block.block, capacity());
+		}
+		{
+			std::unique_lock<isam_impl::shared_latch> latch(block_latch(_current_block.idx));
+			view.erase(pos, pos + 1);
+			_current_block.count = view.count();
+		}
+		if (_current_block.count < min_fill())
+		{
+			std::unique_lock<isam_impl::shared_latch> structure(_latch);
+			compact(block, block + 1);
+		}
+		if (_log) log_record(log_erase, key, nullptr, 0);
+		return 1;
+	}
+
+	// removes the records with keys in [lo, hi) (see range()), returns their number
+	size_t erase(const TKey& lo, const TKey& hi)
+	{
+		if (!(lo < hi)) return 0;
+		std::unique_lock<isam_impl::shared_latch> structure(_latch);
+		size_t erased;
+		{
+			std::unique_lock<isam_impl::shared_latch> oflow(_oflow_latch);
+			erased = _oflow.erase(lo, hi);
+			_oflow_count -= erased;
+		}
+
+		load_block(0); // blocks are rewritten below, readers are kept out by the structure latch
+		size_t first = _index.lower_bound(lo), last = first;
+		while (last < _index.size())
+		{
+			size_t pos = last++;
+			isam_impl::isam_block<TKey, TValue> block(_provider, _index.id(pos));
+			block_view view(block.block, capacity());
+			size_t from = view.lower_bound(block.count, lo), to = view.lower_bound(block.count, hi);
+			if (from < to && shared(block.idx))
 			{
-				return add_to_current_block(key);
+				_provider->release_block(block.idx);
+				block = isam_impl::isam_block<TKey, TValue>(_provider, copy_block(pos));
+				view = block_view(block.block, capacity());
 			}
+			view.erase(from, to);
+			erased += to - from;
+			block.store();
+			if (to < block.count) break; // the block holds keys from hi on, so the following blocks do too
 		}
-		// else insert new record to the overflow space (happens when there is no room or the isam is empty)
-		return add_to_oflow(key);
+		compact(first, last);
+		if (_log) log_record(log_erase_range, lo, &hi, sizeof(TKey));
+		return erased;
+	}
+
+	// Durability, for trivially copyable keys and values.
+	// open_log() restores the records saved by an earlier run at path - the last checkpoint (path + ".ckpt") and the
+	// log replayed over it - into this isam, which must be empty, and then logs every insert_or_assign and erase.
+	// Keys assigned through operator[] are logged with the value they hold at the next commit(), writes through
+	// iterators are not logged. With sync_each_write, each logged operation returns once it is durable, otherwise
+	// commit() makes all preceding ones durable at once. The log is logical, so reorganizations are not logged.
+	void open_log(const std::string& path, bool sync_each_write = false)
+	{
+		static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value, "isam::open_log: keys and values must be trivially copyable");
+		if (_log || !_index.empty() || _oflow_count != 0) throw std::logic_error("isam::open_log: the isam must be empty and without a log");
+
+		std::vector<std::pair<TKey, TValue>> records;
+		if (isam_impl::read_checkpoint(path + ".ckpt", records)) bulk_load(records.begin(), records.end());
+		std::unique_ptr<isam_impl::write_ahead_log> log(new isam_impl::write_ahead_log(path));
+		log->replay([this](const char* data, size_t size) { replay_record(data, size); });
+		_log = std::move(log);
+		_log_path = path;
+		_sync_each_write = sync_each_write;
+	}
+
+	// makes every logged operation durable with a single sync of the log
+	void commit()
+	{
+		if (!_log) return;
+		std::sort(_log_pending.begin(), _log_pending.end());
+		_log_pending.erase(std::unique(_log_pending.begin(), _log_pending.end(), [](const TKey& a, const TKey& b) { return !(a < b) && !(b < a); }), _log_pending.end());
+		for (auto& key : _log_pending)
+		{
+			// erased ones logged their erase
+			probe(key, [&](const TValue& value) { log_record(log_assign, key, &value, sizeof(TValue), false); });
+		}
+		_log_pending.clear();
+		_log->commit();
+	}
+
+	// saves all records to the checkpoint file and empties the log, bounding the log and the replay of open_log()
+	void checkpoint()
+	{
+		if (!_log) throw std::logic_error("isam::checkpoint: no log opened");
+		commit();
+		isam_impl::checkpoint_writer out(_log_path + ".ckpt", sizeof(TKey), sizeof(TValue));
+		uint64_t count = 0;
+		for (auto it = cbegin(); it != cend(); ++it, ++count)
+		{
+			out.append(&it->first, sizeof(TKey));
+			out.append(&it->second, sizeof(TValue));
+		}
+		out.finish(count);
+		_log->truncate(); // a crash before this replays the log over the new checkpoint, which yields the same records
+	}
+
+	// blocks are kept in the given provider, which may be shared with other isam instances
+	// without one, the isam keeps its blocks in a memory_provider of its own
+	// with a compile-time BlockCapacity, block_size must be equal to it
+	isam(size_t block_size, size_t oflow_size, block_provider::provider* provider = nullptr)
+		: _own_provider(provider == nullptr ? new block_provider::memory_provider() : nullptr),
+		_provider(provider == nullptr ? _own_provider.get() : provider),
+		_oflow(oflow_size), _block_size(block_size), _oflow_size(oflow_size), _current_block(_provider, 0)
+	{
+		if (BlockCapacity != 0 && block_size != BlockCapacity) throw std::invalid_argument("isam: block_size differs from BlockCapacity");
+		_block_real_size = _provider->aligned_block_size(isam_impl::block_bytes<TKey, TValue, TLayout>(block_size));
 	}
 
-	isam(size_t block_size, size_t oflow_size) : _block_size(block_size), _oflow_size(oflow_size), _current_block(0)
+	// static_isam with its blocks in a memory_provider of its own
+	explicit isam(size_t oflow_size) : isam(BlockCapacity, oflow_size)
 	{
-		_oflow = std::set<std::pair<TKey, TValue>, isam_impl::ComparePairFst<TKey, TValue>>();
-		_block_real_size = 16 + (block_size * sizeof(std::pair<TKey, TValue>));
+		static_assert(BlockCapacity != 0, "isam: the block size has to be given when BlockCapacity is 0");
 	}
 
 	isam(const isam&) = delete;
 
 	~isam()
 	{
+		if (_log)
+		{
+			try { commit(); } catch (...) {}
+		}
 		if (_current_block.idx != 0) push_current_block();
+		reclaim(); // the snapshots are gone by now, so this frees every retired block
+		for (size_t pos = 0; pos < _index.size(); ++pos)
+		{
+			size_t block_id = _index.id(pos);
+			if constexpr (!std::is_trivially_destructible<TValue>::value) // the values in the blocks live as long as the isam
+			{
+				block_view view(_provider->load_block(block_id), capacity());
+				view.destroy(0, view.count());
+				_provider->release_block(block_id);
+			}
+			if (!_own_provider) _provider->free_block(block_id); // a shared provider outlives the isam, an own one goes with it
+		}
 	}
 
-	class isam_iter
+	// Iterators over the records in key order. An isam_iter hands out writable records and writes a block it leaves
+	// back into the provider (store_block) once it handed out one of its records, otherwise it releases the block
+	// unchanged (release_block) like a const_isam_iter, so lookups and read-only scans leave no dirty blocks behind.
+	// Before it hands out a record of a block that a snapshot shares, it replaces the block by a copy, as the writer
+	// does (see copy_block). The const overloads return const_isam_iter.
+	template<bool IsConst>
+	class basic_isam_iter
 	{
+		typedef typename std::conditional<IsConst, const std::pair<TKey, TValue>, std::pair<TKey, TValue>>::type oflow_record;
+		typedef typename std::conditional<IsConst, const isam, isam>::type owner_type;
+
 	public:
-		typedef isam_iter self_type;
+		typedef basic_isam_iter self_type;
 		typedef std::pair<TKey, TValue> value_type;
-		typedef std::pair<TKey, TValue>& reference;
-		typedef std::pair<TKey, TValue>* pointer;
+		// std::pair<TKey, TValue>& (const for const_isam_iter) for aos_layout
+		typedef typename std::conditional<!IsConst, typename block_view::reference,
+			typename std::conditional<std::is_reference<typename block_view::reference>::value,
+				const std::pair<TKey, TValue>&, isam_impl::record_ref<TKey, const TValue>>::type>::type reference;
+		typedef typename std::conditional<std::is_reference<reference>::value, typename std::remove_reference<reference>::type*, reference>::type pointer;
 		typedef std::forward_iterator_tag iterator_category;
 		typedef ptrdiff_t difference_type;
 
-		isam_iter & operator++()
+		basic_isam_iter & operator++()
 		{
 			// find out whether to move inside overflow or inside the block
 			bool oflow_move; bool check_both = true;
@@ -246,7 +864,7 @@ public:
 			if (_block.idx == 0) { oflow_move = true; check_both = false; }
 			if (check_both)
 			{
-				oflow_move = (_oflow_it->first < _block_ptr->first);
+				oflow_move = (_oflow_it->first < _view.key(_index_in_block));
 			}
 
 			if (oflow_move)
@@ -257,11 +875,7 @@ public:
 			else
 			{
 				if (_index_in_block == _block.count - 1) load_next_block();
-				else
-				{
-					++_index_in_block;
-					++_block_ptr;
-				}
+				else ++_index_in_block;
 			}
 			// if we can't move, transform this iterator into a past-the-end iterator
 			if (_block.idx == 0 && _index_in_oflow == _oflow_size)
@@ -272,100 +886,201 @@ public:
 			return *this;
 		}
 
-		isam_iter operator++(int) // postfix variant
+		basic_isam_iter operator++(int) // postfix variant
 		{
-			isam_iter result(*this);
+			basic_isam_iter result(*this);
 			++(*this);
 			return result;
 		}
 
-		bool operator ==(const isam_iter& b) const
+		bool operator ==(const basic_isam_iter& b) const
 		{
 			return (b._block.idx == _block.idx && b._index_in_block == _index_in_block && b._index_in_oflow == _index_in_oflow);
 		}
 
-		bool operator !=(const isam_iter& b) const
+		bool operator !=(const basic_isam_iter& b) const
 		{
 			return !operator==(b);
 		}
 
-		isam_iter& operator=(const isam_iter& i)
+		basic_isam_iter& operator=(const basic_isam_iter& i)
 		{
-			_index_in_block = i._index_in_block;
-			_index_in_oflow = i._index_in_oflow;
-			_oflow_size = i._oflow_size;
-			_oflow_it = i._oflow_it;
-			if (_block.idx != 0) block_provider::store_block(_block.idx, _block.block);
-			_block = isam_impl::isam_block<TKey, TValue>(i._block.idx);
-			if (_block.idx != 0) // set the block ptr to the correct element
-			{
-				size_t* skipper = (reinterpret_cast<size_t*>(_block.block) + 2);
-				_block_ptr = reinterpret_cast<std::pair<TKey, TValue>*>(skipper);
-				_block_ptr += _index_in_block;
-			}
+			assign(i);
 			return *this;
 		}
 
-		std::pair<TKey, TValue>& operator *() const
+		reference operator *() const
+		{
+			if (_block.idx == 0) return make_ref(*_oflow_it);
+			if (_index_in_oflow == _oflow_size) return block_record();
+			if (_oflow_it->first < _view.key(_index_in_block)) return make_ref(*_oflow_it);
+			return block_record();
+		}
+
+		// the key of the record, without handing the record out for writing
+		const TKey& key() const
 		{
-			return *(operator->());
+			if (_block.idx == 0) return _oflow_it->first;
+			if (_index_in_oflow == _oflow_size) return _view.key(_index_in_block);
+			if (_oflow_it->first < _view.key(_index_in_block)) return _oflow_it->first;
+			return _view.key(_index_in_block);
 		}
 
-		std::pair<TKey, TValue>* operator ->() const
+		pointer operator ->() const
 		{
-			if (_block.idx == 0) return isam_impl::to_pair_ptr<TKey, TValue>(_oflow_it);
-			if (_index_in_oflow == _oflow_size) return _block_ptr;
-			if (_oflow_it->first < _block_ptr->first) return isam_impl::to_pair_ptr<TKey, TValue>(_oflow_it);
-			return _block_ptr;
+			if constexpr (std::is_reference<reference>::value) return &operator*();
+			else return operator*();
 		}
 
-		isam_iter() : _block(0), _index_in_block(1), _index_in_oflow(0) {} // end iterator constructor
+		basic_isam_iter() : _block(nullptr, 0), _index_in_block(1), _index_in_oflow(0), _view(nullptr, 0) {} // end iterator constructor
 
-		isam_iter(const isam_iter& i) : isam_iter() // copy constructor
+		basic_isam_iter(const basic_isam_iter& i) : basic_isam_iter() // copy constructor
 		{
-			operator=(i);
+			assign(i);
 		}
 
-		isam_iter(size_t block, typename std::set<std::pair<TKey, TValue>, isam_impl::ComparePairFst<TKey, TValue>>::iterator o_it, size_t oflow_size) : _block(block), _index_in_block(0), _index_in_oflow(0), _oflow_size(oflow_size)
+		// an isam_iter converts to a const_isam_iter
+		template<bool OtherConst, class = typename std::enable_if<IsConst && !OtherConst>::type>
+		basic_isam_iter(const basic_isam_iter<OtherConst>& i) : basic_isam_iter()
 		{
-			if (block == 0 && oflow_size == 0) _index_in_block = 1;
-			_oflow_it = o_it;
-			size_t* skipper = (reinterpret_cast<size_t*>(_block.block) + 2);
-			_block_ptr = reinterpret_cast<std::pair<TKey, TValue>*>(skipper);
+			assign(i);
 		}
 
-		~isam_iter()
+		// at the first record of the block at block_pos (in owner's index) and of the overflow area
+		basic_isam_iter(owner_type* owner, size_t block_pos) : _owner(owner), _block_pos(block_pos), _block(owner->_provider, block_id(owner, block_pos)), _index_in_block(0), _index_in_oflow(0), _view(_block.block, owner->capacity()), _oflow_size(owner->_oflow_count), _capacity(owner->capacity())
 		{
-			if (_block.idx != 0) block_provider::store_block(_block.idx, _block.block);
+			if (_block.idx == 0 && _oflow_size == 0) _index_in_block = 1;
+			_oflow_it = owner->_oflow.begin();
 		}
 
-	private:
-		isam_impl::isam_block<TKey, TValue> _block;
-		size_t _index_in_block;
-		size_t _index_in_oflow;
-		std::pair<TKey, TValue>* _block_ptr;
-		typename std::set<std::pair<TKey, TValue>, isam_impl::ComparePairFst<TKey, TValue>>::iterator _oflow_it;
-		size_t _oflow_size;
+		// positioned at the first record not smaller than key, block_pos must be the first block whose maximum is not smaller
+		basic_isam_iter(owner_type* owner, size_t block_pos, const TKey& key) : _owner(owner), _block_pos(block_pos), _block(owner->_provider, block_id(owner, block_pos)), _index_in_block(0), _view(_block.block, owner->capacity()), _oflow_size(owner->_oflow_count), _capacity(owner->capacity())
+		{
+			_index_in_oflow = isam_impl::block_lower_bound(owner->_oflow.begin(), _oflow_size, key);
+			_oflow_it = owner->_oflow.begin() + _index_in_oflow;
+			if (_block.idx != 0)
+			{
+				_index_in_block = _view.lower_bound(_block.count, key);
+				// the maximum of a block outlives an erase of its last record, the next block then starts above key
+				if (_index_in_block == _block.count) load_next_block();
+			}
+			if (_block.idx == 0 && _index_in_oflow == _oflow_size) // nothing left -> end iterator
+			{
+				_index_in_block = 1;
+				_index_in_oflow = 0;
+			}
+		}
+
+		~basic_isam_iter()
+		{
+			leave_block();
+		}
+
+	private:
+		template<bool> friend class basic_isam_iter;
+
+		owner_type* _owner = nullptr;
+		size_t _block_pos = 0; // of the loaded block in the owner's index
+		mutable isam_impl::isam_block<TKey, TValue> _block; // replaced by a copy on the first write (see write_access)
+		size_t _index_in_block;
+		size_t _index_in_oflow;
+		mutable block_view _view;
+		oflow_record* _oflow_it = nullptr;
+		size_t _oflow_size = 0;
+		size_t _capacity = 0; // records per block (unused with a compile-time BlockCapacity)
+		mutable bool _written = false; // a record of the loaded block was handed out by an isam_iter
+
+		template<bool OtherConst>
+		void assign(const basic_isam_iter<OtherConst>& i)
+		{
+			_index_in_block = i._index_in_block;
+			_index_in_oflow = i._index_in_oflow;
+			_oflow_size = i._oflow_size;
+			_oflow_it = i._oflow_it;
+			_capacity = i._capacity;
+			_owner = i._owner;
+			_block_pos = i._block_pos;
+			leave_block(); // the records handed out by i stay its own
+			_block = isam_impl::isam_block<TKey, TValue>(i._block.provider, i._block.idx);
+			_view = block_view(_block.block, capacity());
+		}
 
 		void load_next_block()
 		{
 			size_t next_id = _block.next;
-			if (_block.idx != 0) block_provider::store_block(_block.idx, _block.block);
-			_block = isam_impl::isam_block<TKey, TValue>(next_id);
-			if (next_id == 0) return;
-			_index_in_block = 0;
-			size_t* skipper = (reinterpret_cast<size_t*>(_block.block) + 2);
-			_block_ptr = reinterpret_cast<std::pair<TKey, TValue>*>(skipper);
+			leave_block();
+			_block = isam_impl::isam_block<TKey, TValue>(_block.provider, next_id);
+			++_block_pos;
+			_index_in_block = 0; // also once the blocks are exhausted, keeps the iterator distinct from end() while overflow records remain
+			_view = block_view(_block.block, capacity());
+		}
+
+		// only a block whose records were handed out for writing may have changed
+		void leave_block()
+		{
+			if (_block.idx == 0) return;
+			if (_written) _block.store();
+			else _block.provider->release_block(_block.idx);
+			_written = false;
+		}
+
+		static size_t block_id(owner_type* owner, size_t pos)
+		{
+			return pos == owner->_index.size() ? 0 : owner->_index.id(pos);
+		}
+
+		// the first record of the loaded block handed out for writing
+		void write_access() const
+		{
+			_written = true;
+			if constexpr (!IsConst)
+			{
+				if (_owner == nullptr || !_owner->shared(_block.idx)) return;
+				_owner->load_block(0); // the writer's loaded block may be the one replaced
+				size_t copy;
+				{
+					std::unique_lock<isam_impl::shared_latch> structure(_owner->_latch);
+					copy = _owner->copy_block(_block_pos);
+				}
+				_block.provider->release_block(_block.idx);
+				_block = isam_impl::isam_block<TKey, TValue>(_block.provider, copy);
+				_view = block_view(_block.block, capacity());
+			}
+		}
+
+		reference block_record() const
+		{
+			if constexpr (!IsConst) if (!_written) write_access();
+			if constexpr (!IsConst || std::is_reference<reference>::value) return _view.record(_index_in_block);
+			else return reference{ _view.key(_index_in_block), _view.value(_index_in_block) };
+		}
+
+		static reference make_ref(oflow_record& record)
+		{
+			if constexpr (!IsConst) return block_view::make_ref(record);
+			else if constexpr (std::is_reference<reference>::value) return record;
+			else return reference{ record.first, record.second };
+		}
+
+		size_t capacity() const
+		{
+			return BlockCapacity != 0 ? BlockCapacity : _capacity;
 		}
 	};
 
+	typedef basic_isam_iter<false> isam_iter;
+	typedef basic_isam_iter<true> const_isam_iter;
+
 	isam_iter begin()
 	{
 		load_block(0); // push any current changes in the loaded block before creating the iterator
-		size_t id;
-		auto first = _index.begin();
-		id = first == _index.end() ? 0 : first->second;
-		return isam_iter(id, _oflow.begin(), _oflow_count);
+		return isam_iter(this, 0);
+	}
+
+	// the loaded block stays pinned in the provider, so a reading iterator sees its changes without a push
+	const_isam_iter begin() const
+	{
+		return const_isam_iter(this, 0);
 	}
 
 	isam_iter end()
@@ -373,146 +1088,1206 @@ public:
 		return isam_iter(); // block idx == 0 && idx_in_block == 1 && idx_in_oflow == 0 indicates the end() iterator
 	}
 
+	const_isam_iter end() const
+	{
+		return const_isam_iter();
+	}
+
+	const_isam_iter cbegin() const { return begin(); }
+	const_isam_iter cend() const { return end(); }
+
+	// returns an iterator to the record with the given key, or end() if there is none
+	isam_iter find(const TKey& key)
+	{
+		if (filters_rule_out(key)) return end();
+		isam_iter it = lower_bound(key);
+		if (it != end() && !(key < it.key())) return it;
+		return end();
+	}
+
+	const_isam_iter find(const TKey& key) const
+	{
+		if (filters_rule_out(key)) return end();
+		const_isam_iter it = lower_bound(key);
+		if (it != end() && !(key < it.key())) return it;
+		return end();
+	}
+
+	// Seekable scans: the iterator is placed directly on the right block (through _index) and overflow position,
+	// instead of walking from begin().
+
+	// iterator at the first record whose key is not smaller than key
+	isam_iter lower_bound(const TKey& key)
+	{
+		return isam_iter(this, _index.lower_bound(key), key);
+	}
+
+	const_isam_iter lower_bound(const TKey& key) const
+	{
+		return const_isam_iter(this, _index.lower_bound(key), key);
+	}
+
+	// iterator at the first record whose key is greater than key
+	isam_iter upper_bound(const TKey& key)
+	{
+		isam_iter it = lower_bound(key);
+		if (it != end() && !(key < it.key())) ++it;
+		return it;
+	}
+
+	const_isam_iter upper_bound(const TKey& key) const
+	{
+		const_isam_iter it = lower_bound(key);
+		if (it != end() && !(key < it.key())) ++it;
+		return it;
+	}
+
+	std::pair<isam_iter, isam_iter> equal_range(const TKey& key)
+	{
+		isam_iter first = lower_bound(key);
+		isam_iter last = first;
+		if (last != end() && !(key < last.key())) ++last;
+		return std::make_pair(first, last);
+	}
+
+	std::pair<const_isam_iter, const_isam_iter> equal_range(const TKey& key) const
+	{
+		const_isam_iter first = lower_bound(key);
+		const_isam_iter last = first;
+		if (last != end() && !(key < last.key())) ++last;
+		return std::make_pair(first, last);
+	}
+
+	// view of the records with keys in [lo, hi), usable in a range-based for
+	template<class TIter>
+	class basic_isam_range
+	{
+	public:
+		basic_isam_range(const TIter& first, const TIter& last) : _first(first), _last(last) {}
+
+		TIter begin() const { return _first; }
+		TIter end() const { return _last; }
+
+	private:
+		TIter _first;
+		TIter _last;
+	};
+
+	typedef basic_isam_range<isam_iter> isam_range;
+	typedef basic_isam_range<const_isam_iter> const_isam_range;
+
+	isam_range range(const TKey& lo, const TKey& hi)
+	{
+		if (hi < lo) return isam_range(lower_bound(lo), lower_bound(lo));
+		return isam_range(lower_bound(lo), lower_bound(hi));
+	}
+
+	const_isam_range range(const TKey& lo, const TKey& hi) const
+	{
+		if (hi < lo) return const_isam_range(lower_bound(lo), lower_bound(lo));
+		return const_isam_range(lower_bound(lo), lower_bound(hi));
+	}
+
+	// Consistent read view of the isam at the time of snapshot(), for long scans that must not stall the writer.
+	// It keeps a copy of _index and of the overflow area, and reads the blocks themselves: while it lives, the
+	// writer copies a block before modifying it, also through an isam_iter (copy on write), and retires the old
+	// version, which is freed once every snapshot that may read it is released. A snapshot is used by one thread at
+	// a time, not necessarily the writer's, and must be released before the isam is destroyed. Its records are
+	// read-only.
+	class isam_snapshot
+	{
+	public:
+		class snapshot_iter
+		{
+		public:
+			typedef snapshot_iter self_type;
+			typedef std::pair<TKey, TValue> value_type;
+			// const std::pair<TKey, TValue>& for aos_layout
+			typedef typename std::conditional<std::is_reference<typename block_view::reference>::value,
+				const std::pair<TKey, TValue>&, isam_impl::record_ref<TKey, const TValue>>::type reference;
+			typedef typename std::conditional<std::is_reference<reference>::value, const std::pair<TKey, TValue>*, reference>::type pointer;
+			typedef std::forward_iterator_tag iterator_category;
+			typedef ptrdiff_t difference_type;
+
+			snapshot_iter() = default;
+
+			// positioned at the first record of the block at block_pos not smaller than key and at oflow_pos
+			snapshot_iter(const isam_snapshot* snapshot, size_t block_pos, const TKey* key, size_t oflow_pos)
+				: _snapshot(snapshot), _index_in_oflow(oflow_pos)
+			{
+				enter(block_pos);
+				if (key != nullptr && _data != nullptr)
+				{
+					_index_in_block = view().lower_bound(_count, *key);
+					if (_index_in_block == _count) enter(_block_pos + 1);
+				}
+			}
+
+			snapshot_iter(const snapshot_iter& i) : _snapshot(i._snapshot), _index_in_oflow(i._index_in_oflow)
+			{
+				enter(i._block_pos);
+				_index_in_block = i._index_in_block;
+			}
+
+			snapshot_iter& operator=(const snapshot_iter& i)
+			{
+				if (this == &i) return *this;
+				leave();
+				_snapshot = i._snapshot;
+				_index_in_oflow = i._index_in_oflow;
+				enter(i._block_pos);
+				_index_in_block = i._index_in_block;
+				return *this;
+			}
+
+			~snapshot_iter()
+			{
+				leave();
+			}
+
+			snapshot_iter& operator++()
+			{
+				if (at_oflow()) ++_index_in_oflow;
+				else if (++_index_in_block == _count) enter(_block_pos + 1);
+				return *this;
+			}
+
+			snapshot_iter operator++(int) // postfix variant
+			{
+				snapshot_iter result(*this);
+				++(*this);
+				return result;
+			}
+
+			bool operator ==(const snapshot_iter& b) const
+			{
+				return _block_pos == b._block_pos && _index_in_block == b._index_in_block && _index_in_oflow == b._index_in_oflow;
+			}
+
+			bool operator !=(const snapshot_iter& b) const
+			{
+				return !operator==(b);
+			}
+
+			reference operator *() const
+			{
+				if (at_oflow()) return make_ref(_snapshot->_oflow[_index_in_oflow]);
+				if constexpr (std::is_reference<reference>::value) return view().record(_index_in_block);
+				else return reference{ view().key(_index_in_block), view().value(_index_in_block) };
+			}
+
+			pointer operator ->() const
+			{
+				if constexpr (std::is_reference<reference>::value) return &operator*();
+				else return operator*();
+			}
+
+		private:
+			const isam_snapshot* _snapshot = nullptr;
+			size_t _block_pos = 0; // in the snapshot's index, its size once the blocks are exhausted
+			size_t _index_in_block = 0;
+			size_t _index_in_oflow = 0;
+			void* _data = nullptr; // the loaded block at _block_pos
+			size_t _count = 0;
+
+			block_view view() const { return block_view(_data, _snapshot->capacity()); }
+
+			bool at_oflow() const
+			{
+				if (_index_in_oflow == _snapshot->_oflow.size()) return false;
+				return _data == nullptr || _snapshot->_oflow[_index_in_oflow].first < view().key(_index_in_block);
+			}
+
+			static reference make_ref(const std::pair<TKey, TValue>& record)
+			{
+				if constexpr (std::is_reference<reference>::value) return record;
+				else return reference{ record.first, record.second };
+			}
+
+			// loads the first nonempty block from pos on
+			void enter(size_t pos)
+			{
+				leave();
+				_index_in_block = 0;
+				if (_snapshot == nullptr) return;
+				for (_block_pos = pos; _block_pos < _snapshot->_index.size(); ++_block_pos)
+				{
+					_data = _snapshot->_provider->load_block(_snapshot->_index.id(_block_pos));
+					_count = view().count();
+					if (_count != 0) return;
+					leave();
+				}
+			}
+
+			void leave()
+			{
+				if (_data == nullptr) return;
+				_snapshot->_provider->release_block(_snapshot->_index.id(_block_pos));
+				_data = nullptr;
+				_count = 0;
+			}
+		};
+
+		isam_snapshot(isam_snapshot&& other) noexcept
+			: _owner(other._owner), _epoch(other._epoch), _provider(other._provider), _capacity(other._capacity), _oflow(std::move(other._oflow))
+		{
+			_index.swap(other._index);
+			other._owner = nullptr;
+		}
+
+		isam_snapshot(const isam_snapshot&) = delete;
+		isam_snapshot& operator=(const isam_snapshot&) = delete;
+
+		~isam_snapshot()
+		{
+			if (_owner != nullptr) _owner->release_snapshot(_epoch);
+		}
+
+		snapshot_iter begin() const { return snapshot_iter(this, 0, nullptr, 0); }
+		snapshot_iter end() const { return snapshot_iter(this, _index.size(), nullptr, _oflow.size()); }
+
+		// iterator at the first record whose key is not smaller than key
+		snapshot_iter lower_bound(const TKey& key) const
+		{
+			return snapshot_iter(this, _index.lower_bound(key), &key, isam_impl::block_lower_bound(_oflow.data(), _oflow.size(), key));
+		}
+
+		// copies the value key had when the snapshot was taken into out, returns false if the key was not present
+		bool get(const TKey& key, TValue& out) const
+		{
+			size_t pos = isam_impl::block_lower_bound(_oflow.data(), _oflow.size(), key);
+			if (pos < _oflow.size() && !(key < _oflow[pos].first))
+			{
+				out = _oflow[pos].second;
+				return true;
+			}
+			size_t block = _index.lower_bound(key);
+			if (block == _index.size()) return false;
+			size_t block_id = _index.id(block);
+			block_view view(_provider->load_block(block_id), capacity());
+			size_t count = view.count();
+			pos = view.lower_bound(count, key);
+			bool found = pos < count && !(key < view.key(pos));
+			if (found) out = view.value(pos);
+			_provider->release_block(block_id);
+			return found;
+		}
+
+	private:
+		friend class isam;
+
+		isam* _owner;
+		size_t _epoch;
+		block_provider::provider* _provider;
+		size_t _capacity;
+		isam_impl::static_index<TKey> _index;
+		std::vector<std::pair<TKey, TValue>> _oflow;
+
+		isam_snapshot(isam* owner, size_t epoch, const isam_impl::static_index<TKey>& index, const isam_impl::oflow_area<TKey, TValue>& oflow)
+			: _owner(owner), _epoch(epoch), _provider(owner->_provider), _capacity(owner->capacity()), _index(index), _oflow(oflow.begin(), oflow.end())
+		{
+		}
+
+		size_t capacity() const
+		{
+			return BlockCapacity != 0 ? BlockCapacity : _capacity;
+		}
+	};
+
+	// takes a snapshot (see isam_snapshot), to be called by the writer thread
+	isam_snapshot snapshot()
+	{
+		static_assert(std::is_copy_constructible<TValue>::value, "isam::snapshot: values must be copyable");
+		reclaim();
+		size_t epoch = _epoch++;
+		{
+			std::lock_guard<std::mutex> latch(_snapshot_latch);
+			_snapshot_epochs.insert(epoch);
+		}
+		_shared_epoch = epoch + 1;
+		return isam_snapshot(this, epoch, _index, _oflow);
+	}
+
+	// Bloom filters that answer most lookups of absent keys without loading a block: one per block, kept beside
+	// _index, and one over the overflow area, so that get(), contains(), at(), find() and erase() skip the block
+	// probe (and the overflow search) when the filters rule the key out. bits_per_key trades memory for the false
+	// positive rate, 10 gives about 1 %, 0 drops the filters. Filters of blocks only learn keys until the block is
+	// rewritten by a reorganization, so erased keys cost false positives until then.
+	// Keys need a std::hash or a representation without padding bytes.
+	void enable_filters(size_t bits_per_key = 10)
+	{
+		static_assert(isam_impl::filterable_key<TKey>(), "isam::enable_filters: keys need a std::hash or a representation without padding");
+		std::unique_lock<isam_impl::shared_latch> structure(_latch);
+		std::unique_lock<isam_impl::shared_latch> oflow(_oflow_latch);
+		load_block(0); // write back the current block, its keys are read below
+		_filter_bits = bits_per_key;
+		_filters.clear();
+		_oflow_filter = bits_per_key != 0 ? isam_impl::bloom_filter(_oflow_size, bits_per_key) : isam_impl::bloom_filter();
+		if (bits_per_key == 0) return;
+		for (auto rec = _oflow.begin(); rec != _oflow.end(); ++rec) _oflow_filter.add(isam_impl::key_hash(rec->first));
+		for (size_t pos = 0; pos < _index.size(); ++pos)
+		{
+			size_t block_id = _index.id(pos);
+			filter_block(block_id, block_view(_provider->load_block(block_id), capacity()));
+			_provider->release_block(block_id);
+		}
+	}
+
+	// Snapshot of the statistics of this isam (see isam_stats.hpp), safe to call while other threads use it.
+	// The counters are kept unless ISAM_NO_STATS is defined. The fill histogram reads the header of every block.
+	isam_stats stats() const
+	{
+		isam_stats result;
+		result.oflow_hits = _counters.oflow_hits.load();
+		result.oflow_misses = _counters.oflow_misses.load();
+		result.block_loads = _counters.block_loads.load();
+		result.block_switches = _counters.block_switches.load();
+		result.oflow_pushes = _counters.oflow_pushes.load();
+		result.oflow_push_ns = _counters.oflow_push_ns.load();
+		result.oflow_push_max_ns = _counters.oflow_push_max_ns.load();
+		result.splits = _counters.splits.load();
+		result.shift_bytes = _counters.shift_bytes.load();
+		result.merges = _counters.merges.load();
+		result.filter_skips = _counters.filter_skips.load();
+		result.filter_false_positives = _counters.filter_false_positives.load();
+		result.block_copies = _counters.block_copies.load();
+		_counters.lookup_latency.copy_to(result.lookup_latency);
+		_counters.insert_latency.copy_to(result.insert_latency);
+
+		isam_impl::shared_guard structure(_latch);
+		{
+			isam_impl::shared_guard oflow(_oflow_latch);
+			result.oflow_records = _oflow.size();
+			result.filter_bytes = _oflow_filter.bytes();
+		}
+		for (auto& filter : _filters) result.filter_bytes += filter.second.bytes();
+		for (size_t pos = 0; pos < _index.size(); ++pos)
+		{
+			size_t block_id = _index.id(pos);
+			void* data = _provider->load_block(block_id);
+			size_t count;
+			{
+				isam_impl::shared_guard latch(block_latch(block_id));
+				count = block_view(data, capacity()).count();
+			}
+			_provider->release_block(block_id);
+			++result.blocks;
+			result.records += count;
+			size_t bucket = count * isam_stats::fill_buckets / capacity();
+			++result.fill_histogram[bucket < isam_stats::fill_buckets ? bucket : isam_stats::fill_buckets - 1];
+		}
+		result.records += result.oflow_records;
+		result.provider = _provider->stats();
+		return result;
+	}
+
+	// builds the primary file from records sorted by key (no duplicates) in one sequential pass
+	// every block receives fill_factor * block_size records, leaving the rest of it for later inserts
+	// an isam that already holds records gets them inserted one by one instead
+	// with a log opened, the loaded records are saved by a checkpoint rather than logged one by one
+	template<class TIter>
+	void bulk_load(TIter first, TIter last, double fill_factor = 1.0)
+	{
+		if (!_index.empty() || _oflow_count != 0)
+		{
+			for (; first != last; ++first) (*this)[(*first).first] = (*first).second;
+		}
+		else
+		{
+			size_t per_block = static_cast<size_t>(capacity() * fill_factor);
+			if (per_block == 0) per_block = 1;
+			if (per_block > capacity()) per_block = capacity();
+
+			std::unique_lock<isam_impl::shared_latch> structure(_latch);
+			build_chain(first, last, per_block);
+		}
+		if (_log) checkpoint();
+	}
+
 private:
-	std::map<TKey, size_t> _index = std::map<TKey, size_t>(); // Maps TKeys to block IDs
-	std::set<std::pair<TKey, TValue>, isam_impl::ComparePairFst<TKey, TValue>> _oflow; // TKeys are guaranteed to not contain duplicates
-	size_t _block_size; // Number of (TKey, TValue) records
+	std::unique_ptr<block_provider::provider> _own_provider; // set when no provider was passed in
+	block_provider::provider* _provider;
+	isam_impl::static_index<TKey> _index; // maximum key of every block -> block ID
+	isam_impl::oflow_area<TKey, TValue> _oflow; // TKeys are guaranteed to not contain duplicates
+	size_t _block_size; // Number of (TKey, TValue) records, see capacity()
 	size_t _block_real_size; // Number of bytes
 	size_t _oflow_size;
 	size_t _oflow_count = 0;
 	isam_impl::isam_block<TKey, TValue> _current_block;
+	std::vector<std::pair<TKey, TValue>> _merge_buf; // staging area for blocks that are split by push_oflow
+	mutable isam_impl::isam_counters _counters; // see stats()
+	size_t _filter_bits = 0; // bits per key of the Bloom filters, 0 -> no filters (see enable_filters())
+	std::unordered_map<size_t, isam_impl::bloom_filter> _filters; // block ID -> filter of its keys
+	isam_impl::bloom_filter _oflow_filter;
+	// copy on write for snapshots: blocks born before _shared_epoch may be read by a live snapshot
+	size_t _epoch = 1; // taken by the next snapshot
+	size_t _shared_epoch = 0; // 0 -> no live snapshots
+	std::unordered_map<size_t, size_t> _block_births; // block ID -> epoch of its creation, only while snapshots live (missing -> 0)
+	std::deque<std::pair<size_t, size_t>> _retired; // (epoch, block ID) of replaced blocks that snapshots may still read
+	std::mutex _snapshot_latch; // guards _snapshot_epochs, snapshots are released from any thread
+	std::multiset<size_t> _snapshot_epochs; // of the live snapshots
+	std::unique_ptr<isam_impl::write_ahead_log> _log; // see open_log()
+	std::string _log_path;
+	bool _sync_each_write = false;
+	std::vector<TKey> _log_pending; // keys assigned through operator[] since the last commit()
 
-	// insert the overflow records into the main file
-	void push_oflow()
+	// log record: 1b operation, key, then the value (log_assign) or the upper bound (log_erase_range)
+	enum log_operation : unsigned char { log_assign = 1, log_erase = 2, log_erase_range = 3 };
+
+	void log_record(log_operation op, const TKey& key, const void* operand, size_t operand_size)
 	{
-		for (auto&& elem : _oflow)
+		log_record(op, key, operand, operand_size, _sync_each_write);
+	}
+
+	void log_record(log_operation op, const TKey& key, const void* operand, size_t operand_size, bool sync)
+	{
+		char record[1 + sizeof(TKey) + (sizeof(TValue) > sizeof(TKey) ? sizeof(TValue) : sizeof(TKey))];
+		record[0] = static_cast<char>(op);
+		std::memcpy(record + 1, &key, sizeof(TKey));
+		if (operand_size != 0) std::memcpy(record + 1 + sizeof(TKey), operand, operand_size);
+		uint64_t lsn = _log->append(record, 1 + sizeof(TKey) + operand_size);
+		if (sync) _log->commit(lsn);
+	}
+
+	// redoes one log record, called by open_log() before the log is attached, so nothing is logged again
+	void replay_record(const char* data, size_t size)
+	{
+		TKey key;
+		if (size < 1 + sizeof(TKey)) throw std::runtime_error("isam::open_log: damaged log record");
+		std::memcpy(&key, data + 1, sizeof(TKey));
+		switch (data[0])
+		{
+		case log_assign:
+		{
+			if (size != 1 + sizeof(TKey) + sizeof(TValue)) throw std::runtime_error("isam::open_log: damaged log record");
+			TValue value;
+			std::memcpy(&value, data + 1 + sizeof(TKey), sizeof(TValue));
+			insert_or_assign(key, std::move(value));
+			break;
+		}
+		case log_erase:
+			erase(key);
+			break;
+		case log_erase_range:
+		{
+			if (size != 1 + 2 * sizeof(TKey)) throw std::runtime_error("isam::open_log: damaged log record");
+			TKey hi;
+			std::memcpy(&hi, data + 1 + sizeof(TKey), sizeof(TKey));
+			erase(key, hi);
+			break;
+		}
+		default:
+			throw std::runtime_error("isam::open_log: damaged log record");
+		}
+	}
+
+	// records per block, a constant that the compiler can fold into the geometry and loops of a static_isam
+	size_t capacity() const
+	{
+		return BlockCapacity != 0 ? BlockCapacity : _block_size;
+	}
+
+	// blocks with fewer records are merged by erase
+	size_t min_fill() const
+	{
+		size_t min = capacity() / 4;
+		return min == 0 ? 1 : min;
+	}
+
+	// latches for concurrent readers, taken in this order (see get())
+	static const size_t block_latch_count = 64;
+	mutable isam_impl::shared_latch _latch; // index and block chain
+	mutable isam_impl::shared_latch _oflow_latch;
+	mutable isam_impl::shared_latch _block_latches[block_latch_count]; // striped by block ID
+
+	// calls on_found with the value of key while holding the latch that guards it, returns false if the key is not present
+	// see get() for the latching protocol
+	template<class TFound>
+	bool probe(const TKey& key, TFound on_found) const
+	{
+		isam_impl::latency_timer timer(_counters.lookup_latency);
+		isam_impl::shared_guard structure(_latch);
+		uint64_t hash = _filter_bits != 0 ? isam_impl::key_hash(key) : 0;
 		{
-			// check if there is space in an existing block
-			auto block = _index.upper_bound(elem.first);
-			if (block == _index.end()) // we are inserting a key that is larger than all existing ones
+			isam_impl::shared_guard oflow(_oflow_latch);
+			auto rec = _filter_bits == 0 || _oflow_filter.may_contain(hash) ? _oflow.find(key) : nullptr;
+			if (rec != nullptr)
 			{
-				if (_index.rbegin() == _index.rend()) // the index is empty -> create new block
+				_counters.oflow_hits.add();
+				on_found(rec->second);
+				return true;
+			}
+		}
+		_counters.oflow_misses.add();
+
+		size_t block = _index.lower_bound(key);
+		if (block == _index.size()) return false;
+		size_t block_id = _index.id(block);
+		if (filter_excludes(block_id, hash))
+		{
+			_counters.filter_skips.add();
+			return false;
+		}
+		bool found = false;
+		_counters.block_loads.add();
+		void* data = _provider->load_block(block_id);
+		{
+			isam_impl::shared_guard latch(block_latch(block_id));
+			block_view view(data, capacity());
+			size_t count = view.count();
+			size_t pos = view.lower_bound(count, key);
+			if (pos < count && !(key < view.key(pos)))
+			{
+				on_found(view.value(pos));
+				found = true;
+			}
+		}
+		_provider->release_block(block_id);
+		if (!found && _filter_bits != 0) _counters.filter_false_positives.add();
+		return found;
+	}
+
+	// finds the record of key or inserts one with its value constructed from args, returns a pointer to its value
+	// and whether it was inserted
+	// with assign, the value of an existing record is overwritten by the single argument as well
+	template<class... TArgs>
+	std::pair<TValue*, bool> upsert(const TKey& key, bool assign, TArgs&&... args)
+	{
+		isam_impl::latency_timer timer(_counters.insert_latency);
+		// in case the key exists in the container, returns the value
+		// check overflow space first
+		uint64_t hash = _filter_bits != 0 ? isam_impl::key_hash(key) : 0;
+		auto oflow_result = _filter_bits == 0 || _oflow_filter.may_contain(hash) ? _oflow.find(key) : nullptr;
+		if (oflow_result != nullptr)
+		{
+			_counters.oflow_hits.add();
+			if (assign)
+			{
+				std::unique_lock<isam_impl::shared_latch> latch(_oflow_latch);
+				assign_value(oflow_result->second, std::forward<TArgs>(args)...);
+			}
+			return { &oflow_result->second, false };
+		}
+		_counters.oflow_misses.add();
+
+		// find appropriate block in the primary file using the index
+		size_t block = _index.lower_bound(key);
+		bool append = block == _index.size() && block != 0; // above every key: appended to the tail block while it has room
+		if (append) --block;
+
+		if (block != _index.size())
+		{
+			load_block(_index.id(block));
+			auto result = try_get_value(key);
+			if ((result != nullptr || _current_block.count < capacity()) && shared(_current_block.idx))
+			{
+				own_current_block(block); // the value is handed out or the record inserted
+				result = try_get_value(key);
+			}
+			if (result != nullptr)
+			{
+				if (assign)
 				{
-					size_t new_block = block_provider::create_block(_block_real_size);
-					_current_block = isam_impl::isam_block<TKey, TValue>(new_block);
-					_current_block.set_next(0);
-					TValue& new_elem = add_to_current_block(elem.first);
-					new_elem = elem.second;
-					_index[elem.first] = new_block;
-					continue;
+					std::unique_lock<isam_impl::shared_latch> latch(block_latch(_current_block.idx));
+					assign_value(*result, std::forward<TArgs>(args)...);
 				}
-				// try to insert into the last block and increase its maximum
-				auto last_block = _index.rbegin();
-				load_block((*last_block).second);
-				if (_current_block.count < _block_size) // there is room in the block
+				return { result, false };
+			}
+
+			// in case the key does not exist in the container
+			// if the block is not full insert new record to the block
+			if (_current_block.count < capacity())
+			{
+				TValue& value = add_to_current_block(key, hash, std::forward<TArgs>(args)...);
+				if (append)
 				{
-					TValue& new_elem = add_to_current_block(elem.first);
-					new_elem = elem.second;
-					// increase the key of this block in the index
-					_index.erase((++(_index.rbegin())).base());
-					_index[elem.first] = _current_block.idx;
-					continue;
+					std::unique_lock<isam_impl::shared_latch> structure(_latch);
+					_index.set_key(block, key);
 				}
-				else // no room -> create new block
+				return { &value, true };
+			}
+			if (append) return { &add_to_new_tail(key, std::forward<TArgs>(args)...), true };
+		}
+		// else insert new record to the overflow space (happens when there is no room or the isam is empty)
+		return { &add_to_oflow(key, hash, std::forward<TArgs>(args)...), true };
+	}
+
+	// the assignment of upsert, which only assigns with a single argument
+	static void assign_value(TValue&) {}
+
+	template<class TArg>
+	static void assign_value(TValue& to, TArg&& value)
+	{
+		if constexpr (std::is_assignable<TValue&, TArg&&>::value) to = std::forward<TArg>(value);
+	}
+
+	template<class TArg, class TNext, class... TRest>
+	static void assign_value(TValue&, TArg&&, TNext&&, TRest&&...) {}
+
+	isam_impl::shared_latch& block_latch(size_t block_id) const
+	{
+		return _block_latches[block_id % block_latch_count];
+	}
+
+	// merges the overflow records into the main file
+	// the sorted overflow is streamed against the index, so every affected block is rewritten exactly once
+	void push_oflow()
+	{
+		isam_impl::stat_timer timer;
+		std::unique_lock<isam_impl::shared_latch> structure(_latch);
+		std::unique_lock<isam_impl::shared_latch> oflow(_oflow_latch);
+		load_block(0); // write back the current block, it may be about to be rewritten
+		if (_index.empty())
+		{
+			build_chain(std::make_move_iterator(_oflow.begin()), std::make_move_iterator(_oflow.end()), capacity());
+		}
+		else
+		{
+			// the index is rebuilt next to the old one: untouched blocks are copied over, rewritten ones re-emitted
+			if (_shared_epoch != 0) // copy the blocks shared with snapshots up front, while their predecessors are known
+			{
+				reclaim();
+				size_t copied_target = _index.size();
+				for (auto rec = _oflow.begin(); rec != _oflow.end(); ++rec)
 				{
-					size_t new_block = block_provider::create_block(_block_real_size);
-					_current_block.set_next(new_block);
-					load_block(new_block);
-					_current_block.set_next(0);
-					TValue& new_elem = add_to_current_block(elem.first);
-					new_elem = elem.second;
-					_index[elem.first] = new_block;
-					continue;
+					size_t target = _index.lower_bound(rec->first);
+					if (target == _index.size()) --target;
+					if (target != copied_target) copy_block(copied_target = target);
 				}
 			}
-			else // check if there is space for insertion
+			isam_impl::static_index<TKey> next_index;
+			next_index.reserve(_index.size() + (_oflow_count + capacity() - 1) / capacity());
+			size_t copied = 0;
+			auto rec = _oflow.begin();
+			while (rec != _oflow.end())
 			{
-				load_block((*block).second);
-				if (_current_block.count < _block_size) // there is room in the block
+				// records belong to the first block whose maximum is not smaller, keys above all maximums go to the last block
+				size_t target = _index.lower_bound(rec->first);
+				if (target == _index.size()) --target;
+				bool last_block = target + 1 == _index.size();
+				auto run_end = rec;
+				size_t run_length = 0;
+				while (run_end != _oflow.end() && (last_block || !(_index.key(target) < run_end->first)))
 				{
-					TValue& new_elem = add_to_current_block(elem.first);
-					new_elem = elem.second;
-					continue;
+					++run_end; ++run_length;
 				}
-				else // no room -> create new block and split elements in half
+				for (; copied < target; ++copied) next_index.push_back(_index.key(copied), _index.id(copied));
+				merge_into_block(_index.id(target), rec, run_end, run_length, next_index);
+				copied = target + 1;
+				rec = run_end;
+			}
+			for (; copied < _index.size(); ++copied) next_index.push_back(_index.key(copied), _index.id(copied));
+			next_index.build();
+			_index.swap(next_index);
+		}
+		_oflow_count = 0; _oflow.clear(); _oflow_filter.clear();
+		size_t elapsed = timer.elapsed_ns();
+		_counters.oflow_pushes.add();
+		_counters.oflow_push_ns.add(elapsed);
+		_counters.oflow_push_max_ns.set_max(elapsed);
+	}
+
+	// writes sorted records into a chain of new blocks holding per_block records each (presumes an empty index)
+	template<class TIter>
+	void build_chain(TIter first, TIter last, size_t per_block)
+	{
+		isam_impl::isam_block<TKey, TValue> block(_provider, 0);
+		while (first != last)
+		{
+			size_t block_id = new_block();
+			if (block.idx != 0) // link the previous block to the new one and write it back
+			{
+				block.set_next(block_id);
+				block.store();
+			}
+			block = isam_impl::isam_block<TKey, TValue>(_provider, block_id);
+			block.set_next(0);
+
+			block_view view(block.block, capacity());
+			size_t count = 0;
+			TKey max_key;
+			for (; first != last && count < per_block; ++first, ++count)
+			{
+				max_key = (*first).first;
+				view.emplace(count, max_key, (*first).second); // moves from move iterators
+			}
+			view.set_count(count);
+			block.count = count;
+			filter_block(block_id, view);
+			_index.push_back(max_key, block_id); // keys arrive sorted -> always appended
+		}
+		block.store();
+		_index.build();
+	}
+
+	// merges the sorted records [first, last) into the block target, rewriting it once, and appends the resulting
+	// block(s) to next_index
+	// if they do not fit, the block is split into as few blocks as possible and the records are spread evenly among them
+	template<class TIter>
+	void merge_into_block(size_t target, TIter first, TIter last, size_t run_length, isam_impl::static_index<TKey>& next_index)
+	{
+		_counters.block_loads.add();
+		isam_impl::isam_block<TKey, TValue> block(_provider, target);
+		block_view view(block.block, capacity());
+		size_t total = block.count + run_length;
+
+		if (total <= capacity()) // everything fits -> merge in place, from the back
+		{
+			size_t i = block.count, w = total;
+			for (auto rec = last; rec != first; )
+			{
+				--rec;
+				while (i > 0 && rec->first < view.key(i - 1))
 				{
-					TKey curr_key = isam_impl::get_max<TKey, TValue>(_current_block.block);
-					size_t new_block_id = block_provider::create_block(_block_real_size);
-					isam_impl::isam_block<TKey, TValue> new_block(new_block_id);
-					new_block.set_next(_current_block.next);
-					_current_block.set_next(new_block_id);
-					TValue& new_item = isam_impl::split<TKey, TValue>(_current_block.block, new_block.block, elem.first);
-					new_item = elem.second;
-					// increase the key of this block in the index
-					// insert new_block into the index with the proper key
-					TKey max_l = isam_impl::get_max<TKey, TValue>(_current_block.block);
-					TKey max_r = isam_impl::get_max<TKey, TValue>(new_block.block);
-					_index.erase(curr_key);
-					_index[max_l] = _current_block.idx;
-					_index[max_r] = new_block_id;
-					block_provider::store_block(new_block_id, new_block.block);
-					continue;
+					--i; --w;
+					place(view, w, block.count, view.key(i), std::move(view.value(i)));
 				}
+				--w;
+				place(view, w, block.count, rec->first, std::move(rec->second));
 			}
+			view.set_count(total);
+			filter_block(block.idx, view);
+			next_index.push_back(view.key(total - 1), block.idx); // only the last block can receive keys above its maximum
+			block.store();
+			return;
 		}
-		_oflow_count = 0; _oflow.clear();
+
+		_merge_buf.clear();
+		size_t i = 0;
+		for (; first != last; ++first)
+		{
+			for (; i < block.count && view.key(i) < first->first; ++i) _merge_buf.emplace_back(view.key(i), std::move(view.value(i)));
+			_merge_buf.push_back(std::move(*first));
+		}
+		for (; i < block.count; ++i) _merge_buf.emplace_back(view.key(i), std::move(view.value(i)));
+
+		size_t block_count = (total + capacity() - 1) / capacity();
+		_counters.splits.add(block_count - 1);
+		size_t per_block = total / block_count, extra = total % block_count;
+		// appending to the tail block (ascending keys) -> fill the blocks, keys to come will not land among them
+		if (block.next == 0 && (block.count == 0 || view.key(block.count - 1) < _merge_buf[block.count].first))
+		{
+			per_block = capacity();
+			extra = 0;
+		}
+		size_t next = block.next;
+		size_t written = 0;
+		for (size_t b = 0; b < block_count; ++b)
+		{
+			size_t count = std::min(per_block + (b < extra ? 1 : 0), total - written);
+			isam_impl::write_records(block_view(block.block, capacity()), _merge_buf.data() + written, count);
+			filter_block(block.idx, block_view(block.block, capacity()));
+			written += count;
+			next_index.push_back(_merge_buf[written - 1].first, block.idx);
+			if (b + 1 < block_count) // continue in a new block linked right after this one
+			{
+				size_t next_block = new_block();
+				block.set_next(next_block);
+				block.store();
+				block = isam_impl::isam_block<TKey, TValue>(_provider, next_block);
+			}
+		}
+		block.set_next(next);
+		block.store();
 	}
 
-	TValue& add_to_oflow(TKey key)
+	// resolves the keys of one group of multi_get() that were not found in the overflow, loading their block once
+	// returns the number of keys found
+	size_t resolve_group(const std::array<size_t, 3>& group, const std::vector<size_t>& order, const std::vector<TKey>& keys, std::vector<std::optional<TValue>>& out) const
 	{
-		// TODO: what to do if oflow_size == 0?
-		if (_oflow_count == _oflow_size)
+		size_t block_id = _index.id(group[0]);
+		if (_filter_bits != 0)
 		{
-			push_oflow();
+			bool any = false;
+			for (size_t k = group[1]; k < group[2] && !any; ++k)
+			{
+				size_t i = order[k];
+				any = !out[i] && !filter_excludes(block_id, isam_impl::key_hash(keys[i]));
+			}
+			if (!any)
+			{
+				_counters.filter_skips.add();
+				return 0;
+			}
 		}
-		_oflow.insert(std::pair<TKey, TValue>(key, TValue()));
-		++_oflow_count;
-		const TValue& ref = (*(_oflow.find(std::pair<TKey, TValue>(key, TValue())))).second;
-		return const_cast<TValue&>(ref); // val is not used for sorting -> const_cast will not break the set
+
+		size_t found = 0;
+		_counters.block_loads.add();
+		void* data = _provider->load_block(block_id);
+		{
+			isam_impl::shared_guard latch(block_latch(block_id));
+			block_view view(data, capacity());
+			size_t count = view.count();
+			for (size_t k = group[1]; k < group[2]; ++k)
+			{
+				size_t i = order[k];
+				if (out[i]) continue; // found in the overflow
+				size_t pos = view.lower_bound(count, keys[i]);
+				if (pos < count && !(keys[i] < view.key(pos)))
+				{
+					out[i] = view.value(pos);
+					++found;
+				}
+			}
+		}
+		_provider->release_block(block_id);
+		return found;
 	}
 
-	// tries to retrieve given value from the current block, returns nullptr if it fails
-	TValue* try_get_value(TKey key) const
+	// whether a live snapshot may read the block, which then must not be modified
+	bool shared(size_t block_id) const
+	{
+		if (_shared_epoch == 0) return false;
+		auto birth = _block_births.find(block_id);
+		return (birth == _block_births.end() ? 0 : birth->second) < _shared_epoch;
+	}
+
+	size_t new_block()
+	{
+		size_t block_id = _provider->create_block(_block_real_size);
+		if (_shared_epoch != 0) _block_births[block_id] = _epoch;
+		return block_id;
+	}
+
+	// Replaces the block at index position pos by a private copy if a snapshot shares it, so that it can be
+	// modified, returns the ID of the block to modify. The copy is linked into the chain in place of the original,
+	// which is retired. Snapshots never follow the links of the chain, so relinking the predecessor is safe.
+	// The structure latch must be held exclusively.
+	size_t copy_block(size_t pos)
 	{
-		auto stp = reinterpret_cast<size_t*>(_current_block.block);
-		stp += 2; // skip header of the block
-		auto payload_ptr = reinterpret_cast<std::pair<TKey, TValue>*>(stp);
-		std::pair<TKey, TValue> rec;
-		for (size_t i = 0; i < _current_block.count; ++i)
+		size_t block_id = _index.id(pos);
+		if (!shared(block_id)) return block_id;
+		reclaim(); // released snapshots need no copy
+		if (!shared(block_id)) return block_id;
+		if constexpr (std::is_copy_constructible<TValue>::value) // snapshot() rejects other values, nothing is shared then
 		{
-			rec = *payload_ptr;
-			if (!(key < rec.first) && !(rec.first < key)) // key was found -> skip TKey and return its TValue
+			size_t copy = new_block();
+			isam_impl::isam_block<TKey, TValue> source(_provider, block_id), target(_provider, copy);
+			if constexpr (isam_impl::trivial_records<TKey, TValue>())
+			{
+				std::memcpy(target.block, source.block, isam_impl::block_bytes<TKey, TValue, TLayout>(capacity()));
+			}
+			else
 			{
-				auto key_p = reinterpret_cast<TKey*>(payload_ptr);
-				++key_p;
-				return reinterpret_cast<TValue*>(key_p);
+				block_view from(source.block, capacity()), to(target.block, capacity());
+				for (size_t i = 0; i < source.count; ++i) to.emplace(i, from.key(i), from.value(i));
+				to.set_count(source.count);
+				target.set_next(source.next);
 			}
-			++payload_ptr;
+			target.store();
+			_provider->release_block(block_id);
+			if (pos > 0)
+			{
+				isam_impl::isam_block<TKey, TValue> previous(_provider, _index.id(pos - 1));
+				previous.set_next(copy);
+				previous.store();
+			}
+			_index.set_id(pos, copy);
+			auto filter = _filters.find(block_id);
+			if (filter != _filters.end())
+			{
+				isam_impl::bloom_filter moved = std::move(filter->second);
+				_filters.erase(filter);
+				_filters.emplace(copy, std::move(moved));
+			}
+			retire_block(block_id);
+			_counters.block_copies.add();
+			return copy;
 		}
-		return nullptr;
+		return block_id;
+	}
+
+	// copy_block() for the writer's current block at index position pos, outside of reorganizations
+	void own_current_block(size_t pos)
+	{
+		load_block(0);
+		{
+			std::unique_lock<isam_impl::shared_latch> structure(_latch);
+			copy_block(pos);
+		}
+		load_block(_index.id(pos));
+	}
+
+	// frees a block that left the index, or keeps it until the snapshots that may read it are released
+	void retire_block(size_t block_id)
+	{
+		_filters.erase(block_id);
+		if (shared(block_id)) _retired.emplace_back(_epoch, block_id);
+		else
+		{
+			_provider->free_block(block_id);
+			_block_births.erase(block_id);
+		}
+	}
+
+	// frees the retired blocks that no live snapshot can read any more
+	void reclaim()
+	{
+		bool live;
+		size_t oldest = 0, newest = 0;
+		{
+			std::lock_guard<std::mutex> latch(_snapshot_latch);
+			live = !_snapshot_epochs.empty();
+			if (live)
+			{
+				oldest = *_snapshot_epochs.begin();
+				newest = *_snapshot_epochs.rbegin();
+			}
+		}
+		// a block retired at epoch e is read only by snapshots taken before e
+		while (!_retired.empty() && (!live || _retired.front().first <= oldest))
+		{
+			size_t block_id = _retired.front().second;
+			_retired.pop_front();
+			if constexpr (!std::is_trivially_destructible<TValue>::value)
+			{
+				block_view view(_provider->load_block(block_id), capacity());
+				view.destroy(0, view.count());
+				_provider->release_block(block_id);
+			}
+			_provider->free_block(block_id);
+			_block_births.erase(block_id);
+		}
+		_shared_epoch = live ? newest + 1 : 0;
+		if (!live) _block_births.clear();
+	}
+
+	void release_snapshot(size_t epoch)
+	{
+		std::lock_guard<std::mutex> latch(_snapshot_latch);
+		_snapshot_epochs.erase(_snapshot_epochs.find(epoch));
+	}
+
+	// rebuilds the filter of a block from its keys, which also drops erased ones
+	// called for every block written by a reorganization, under the exclusive structure latch
+	void filter_block(size_t block_id, const block_view& view)
+	{
+		if (_filter_bits == 0) return;
+		auto& filter = _filters[block_id];
+		if (filter.bytes() == 0) filter = isam_impl::bloom_filter(capacity(), _filter_bits);
+		else filter.clear();
+		size_t count = view.count();
+		for (size_t i = 0; i < count; ++i) filter.add(isam_impl::key_hash(view.key(i)));
+	}
+
+	// whether the filter of the block rules out the key with the given hash, so the block need not be loaded
+	bool filter_excludes(size_t block_id, uint64_t hash) const
+	{
+		if (_filter_bits == 0) return false;
+		auto filter = _filters.find(block_id);
+		if (filter == _filters.end()) return false;
+		isam_impl::shared_guard latch(block_latch(block_id)); // the writer adds keys under it
+		return !filter->second.may_contain(hash);
+	}
+
+	// whether the filters rule out the key, so that find() need not position an iterator
+	bool filters_rule_out(const TKey& key) const
+	{
+		if (_filter_bits == 0) return false;
+		uint64_t hash = isam_impl::key_hash(key);
+		size_t block = _index.lower_bound(key);
+		return !_oflow_filter.may_contain(hash) && (block == _index.size() || filter_excludes(_index.id(block), hash));
+	}
+
+	// moves a record to slot w of a block being merged in place, slots from count on are still unused
+	static void place(const block_view& view, size_t w, size_t count, const TKey& key, TValue&& value)
+	{
+		if (w < count) view.assign(w, key, std::move(value));
+		else view.emplace(w, key, std::move(value));
+	}
+
+	// merges the underfull blocks at index positions [first, last) with their neighbours
+	// the structure latch must be held exclusively
+	void compact(size_t first, size_t last)
+	{
+		load_block(0); // write back the current block, it may be about to be rewritten or freed
+		if (last > _index.size()) last = _index.size();
+		last -= drop_empty_blocks(first, last);
+		while (first < last && first < _index.size())
+		{
+			size_t block_id = _index.id(first);
+			size_t count = block_view(_provider->load_block(block_id), capacity()).count();
+			_provider->release_block(block_id);
+			if (count >= min_fill()) ++first;
+			else if (rebalance(first)) --last; // the merged block may still be underfull, look at it again
+			else ++first;
+		}
+	}
+
+	// frees the empty blocks among [first, last), e.g. the run a range erase leaves behind, without merging them one
+	// by one: they are unlinked from the chain and their index entries removed in one pass
+	// returns the number of freed blocks
+	size_t drop_empty_blocks(size_t first, size_t last)
+	{
+		size_t previous = first == 0 ? 0 : _index.id(first - 1); // the last kept block, linked past the dropped ones
+		size_t successor = 0;
+		bool unlinked = false;
+		auto relink = [&]
+		{
+			if (!unlinked || previous == 0) return;
+			isam_impl::isam_block<TKey, TValue> block(_provider, previous); // snapshots never follow the links
+			block.set_next(successor);
+			block.store();
+		};
+		size_t dropped = _index.erase_if(first, last, [&](size_t pos)
+		{
+			isam_impl::isam_block<TKey, TValue> block(_provider, _index.id(pos));
+			_provider->release_block(block.idx);
+			if (block.count != 0)
+			{
+				relink();
+				unlinked = false;
+				previous = block.idx;
+				return false;
+			}
+			successor = block.next;
+			unlinked = true;
+			retire_block(block.idx);
+			_counters.merges.add();
+			return true;
+		});
+		relink();
+		return dropped;
+	}
+
+	// merges the block at pos with the next one (or the previous one for the last block), if their records do not
+	// fit into one block, spreads them evenly between both instead
+	// returns whether a block was freed
+	bool rebalance(size_t pos)
+	{
+		if (_index.size() == 1) // no neighbour, only an empty block goes away
+		{
+			isam_impl::isam_block<TKey, TValue> block(_provider, _index.id(0));
+			_provider->release_block(block.idx);
+			if (block.count != 0) return false;
+			retire_block(block.idx);
+			_index.clear();
+			return true;
+		}
+
+		size_t left_pos = pos + 1 < _index.size() ? pos : pos - 1;
+		isam_impl::isam_block<TKey, TValue> left(_provider, copy_block(left_pos));
+		isam_impl::isam_block<TKey, TValue> right(_provider, copy_block(left_pos + 1));
+		block_view left_view(left.block, capacity()), right_view(right.block, capacity());
+		size_t total = left.count + right.count;
+		if (total <= capacity())
+		{
+			for (size_t i = 0; i < right.count; ++i) left_view.emplace(left.count + i, right_view.key(i), std::move(right_view.value(i)));
+			right_view.destroy(0, right.count);
+			left_view.set_count(total);
+			left.set_next(right.next);
+			left.store();
+			_provider->release_block(right.idx);
+			retire_block(right.idx);
+			filter_block(left.idx, left_view);
+			TKey max_key = _index.key(left_pos + 1);
+			_index.erase(left_pos + 1);
+			_index.set_key(left_pos, max_key);
+			_counters.merges.add();
+			return true;
+		}
+
+		_merge_buf.clear();
+		for (size_t i = 0; i < left.count; ++i) _merge_buf.emplace_back(left_view.key(i), std::move(left_view.value(i)));
+		for (size_t i = 0; i < right.count; ++i) _merge_buf.emplace_back(right_view.key(i), std::move(right_view.value(i)));
+		size_t left_count = total / 2;
+		isam_impl::write_records(left_view, _merge_buf.data(), left_count);
+		isam_impl::write_records(right_view, _merge_buf.data() + left_count, total - left_count);
+		filter_block(left.idx, left_view);
+		filter_block(right.idx, right_view);
+		_index.set_key(left_pos, _merge_buf[left_count - 1].first);
+		left.store();
+		right.store();
+		return false;
+	}
+
+	// hash: key_hash(key) for the filters, if they are enabled
+	template<class... TArgs>
+	TValue& add_to_oflow(const TKey& key, uint64_t hash, TArgs&&... args)
+	{
+		// a full overflow (or one with no capacity at all) is merged into the main file first
+		if (_oflow_count >= _oflow_size)
+		{
+			push_oflow();
+		}
+		std::unique_lock<isam_impl::shared_latch> latch(_oflow_latch);
+		++_oflow_count;
+		if (_filter_bits != 0) _oflow_filter.add(hash);
+		return _oflow.emplace(key, std::forward<TArgs>(args)...);
+	}
+
+	// tries to retrieve given value from the current block, returns nullptr if it fails
+	TValue* try_get_value(TKey key) const
+	{
+		block_view view(_current_block.block, capacity());
+		size_t pos = view.lower_bound(_current_block.count, key);
+		if (pos == _current_block.count || key < view.key(pos)) return nullptr;
+		return &view.value(pos);
 	}
 
 	// presumes that there is space in the block for inserting (undefined behavior for full block)
-	TValue& add_to_current_block(TKey key)
+	template<class... TArgs>
+	TValue& add_to_current_block(const TKey& key, uint64_t hash, TArgs&&... args)
 	{
+		std::unique_lock<isam_impl::shared_latch> latch(block_latch(_current_block.idx));
+		if (_filter_bits != 0)
+		{
+			auto filter = _filters.find(_current_block.idx);
+			if (filter != _filters.end()) filter->second.add(hash);
+		}
 		_current_block.count += 1;
-		return isam_impl::insert<TKey, TValue>(_current_block.block, key);
+		size_t moved_bytes;
+		TValue& result = block_view(_current_block.block, capacity()).insert(key, moved_bytes, std::forward<TArgs>(args)...);
+		_counters.shift_bytes.add(moved_bytes);
+		return result;
+	}
+
+	// starts a new tail block with a key above all others once the tail block is full, so that ascending inserts
+	// fill block after block without passing through the overflow area
+	template<class... TArgs>
+	TValue& add_to_new_tail(const TKey& key, TArgs&&... args)
+	{
+		load_block(0);
+		std::unique_lock<isam_impl::shared_latch> structure(_latch);
+		size_t block_id = new_block();
+		{
+			// snapshots never follow the links, the tail is relinked even when it is shared
+			isam_impl::isam_block<TKey, TValue> tail(_provider, _index.id(_index.size() - 1));
+			tail.set_next(block_id);
+			tail.store();
+		}
+		load_block(block_id);
+		block_view view(_current_block.block, capacity());
+		TValue& result = view.emplace(0, key, std::forward<TArgs>(args)...);
+		view.set_count(1);
+		_current_block.count = 1;
+		filter_block(block_id, view);
+		_index.append(key, block_id); // the right spine only, a rebuild would make ascending loads quadratic
+		_counters.splits.add();
+		return result;
 	}
 
 	void load_block(size_t id)
 	{
 		if (id != _current_block.idx)
 		{
+			_counters.block_switches.add();
+			if (id != 0) _counters.block_loads.add();
 			if (_current_block.idx != 0) push_current_block();
-			_current_block = isam_impl::isam_block<TKey, TValue>(id);
+			_current_block = isam_impl::isam_block<TKey, TValue>(_provider, id);
 		}
 	}
 
 	// writes the current block back into the provider
 	void push_current_block()
 	{
-		block_provider::store_block(_current_block.idx, _current_block.block);
+		_current_block.store();
 	}
 };
 
+// isam whose block geometry is fixed at compile time, e.g. static_isam<long, item, 64> index(oflow_size)
+// isam_impl::page_capacity<TKey, TValue, TLayout>() gives the capacity that fills one page
+template <class TKey, class TValue, size_t BlockCapacity, class TLayout = isam_impl::aos_layout>
+using static_isam = isam<TKey, TValue, TLayout, BlockCapacity>;
+
 #endif // ISAM_HPP
\ No newline at end of file
@@ -0,0 +1,273 @@
+// Throughput and latency benchmark of isam against std::map and a sorted vector.
+// Build with e.g. g++ -std=c++17 -O2 -march=native isam_bench.cpp -pthread
+// Usage: isam_bench [records], prints one CSV line per structure, geometry and workload.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+#include "isam.hpp"
+
+using namespace std;
+
+typedef long long bench_key;
+typedef long long bench_value;
+
+const size_t scan_length = 100; // records visited per range scan
+const double zipf_exponent = 0.99;
+
+// keys of one run: the records that are loaded and the probes of every workload
+struct workload_keys
+{
+	vector<bench_key> random_order; // distinct even keys in random order
+	vector<bench_key> sorted; // the same keys ascending
+	vector<bench_key> uniform; // probes of present keys, uniformly chosen
+	vector<bench_key> zipf; // probes of present keys, Zipf-distributed over a random ranking
+	vector<bench_key> absent; // probes of odd keys, never present
+	vector<bool> mixed_writes; // per operation of the mixed workload: insert (10 %) or lookup
+};
+
+workload_keys make_keys(size_t n)
+{
+	workload_keys k;
+	mt19937_64 rng(42);
+	k.sorted.resize(n);
+	for (size_t i = 0; i < n; ++i) k.sorted[i] = static_cast<bench_key>(2 * i);
+	k.random_order = k.sorted;
+	shuffle(k.random_order.begin(), k.random_order.end(), rng);
+
+	k.uniform.resize(n);
+	for (auto& p : k.uniform) p = k.sorted[rng() % n];
+
+	vector<double> cdf(n);
+	double sum = 0;
+	for (size_t i = 0; i < n; ++i) cdf[i] = (sum += 1.0 / pow(static_cast<double>(i + 1), zipf_exponent));
+	uniform_real_distribution<double> u(0, sum);
+	k.zipf.resize(n);
+	for (auto& p : k.zipf)
+	{
+		size_t rank = static_cast<size_t>(lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin());
+		p = k.random_order[rank < n ? rank : n - 1]; // random_order doubles as the ranking
+	}
+
+	k.absent.resize(n);
+	for (auto& p : k.absent) p = static_cast<bench_key>(2 * (rng() % n) + 1);
+
+	k.mixed_writes.resize(n);
+	for (size_t i = 0; i < n; ++i) k.mixed_writes[i] = rng() % 10 == 0;
+	return k;
+}
+
+// latencies of the operations of one workload
+class recorder
+{
+public:
+	explicit recorder(size_t ops) { _ns.reserve(ops); }
+
+	template<class F>
+	void run(F op)
+	{
+		auto start = chrono::steady_clock::now();
+		op();
+		auto end = chrono::steady_clock::now();
+		_ns.push_back(chrono::duration<double, nano>(end - start).count());
+	}
+
+	void print(const string& structure, const string& workload, size_t block_size, size_t oflow_size, double blocks_loaded)
+	{
+		double total = accumulate(_ns.begin(), _ns.end(), 0.0);
+		sort(_ns.begin(), _ns.end());
+		cout << structure << "," << workload << "," << block_size << "," << oflow_size << "," << _ns.size() << ","
+			<< (total > 0 ? _ns.size() / total * 1e9 : 0) << "," << percentile(0.5) << "," << percentile(0.99) << ","
+			<< (_ns.empty() ? 0 : blocks_loaded / _ns.size()) << endl;
+	}
+
+private:
+	vector<double> _ns;
+
+	double percentile(double p) const
+	{
+		if (_ns.empty()) return 0;
+		return _ns[static_cast<size_t>(p * (_ns.size() - 1))];
+	}
+};
+
+volatile bench_value sink;
+
+// Adapters with a common interface over the compared structures:
+// insert(key, value), lookup(key) -> bool, scan(key) -> records visited, blocks_loaded()
+
+class isam_adapter
+{
+public:
+	// filter_bits: bits per key of the Bloom filters, 0 -> none
+	isam_adapter(size_t block_size, size_t oflow_size, size_t filter_bits = 0) : _isam(block_size, oflow_size, &_provider)
+	{
+		if (filter_bits != 0) _isam.enable_filters(filter_bits);
+	}
+
+	void insert(bench_key key, bench_value value) { _isam.insert_or_assign(key, value); }
+
+	bool lookup(bench_key key)
+	{
+		bench_value value;
+		if (!_isam.get(key, value)) return false; // value is left unset on a miss
+		sink = value;
+		return true;
+	}
+
+	size_t scan(bench_key key)
+	{
+		size_t visited = 0;
+		const auto& index = _isam; // a reading iterator, it leaves no dirty blocks
+		for (auto it = index.lower_bound(key); it != index.end() && visited < scan_length; ++it, ++visited) sink = it->second;
+		return visited;
+	}
+
+	// every block pinned by lookups, inserts, reorganizations and iterators
+	size_t blocks_loaded() const
+	{
+		auto s = _provider.stats();
+		return s.hits + s.misses;
+	}
+
+private:
+	block_provider::memory_provider _provider;
+	isam<bench_key, bench_value> _isam;
+};
+
+class map_adapter
+{
+public:
+	void insert(bench_key key, bench_value value) { _map[key] = value; }
+
+	bool lookup(bench_key key)
+	{
+		auto it = _map.find(key);
+		if (it == _map.end()) return false;
+		sink = it->second;
+		return true;
+	}
+
+	size_t scan(bench_key key)
+	{
+		size_t visited = 0;
+		for (auto it = _map.lower_bound(key); it != _map.end() && visited < scan_length; ++it, ++visited) sink = it->second;
+		return visited;
+	}
+
+	size_t blocks_loaded() const { return 0; }
+
+private:
+	map<bench_key, bench_value> _map;
+};
+
+class vector_adapter
+{
+public:
+	void insert(bench_key key, bench_value value)
+	{
+		auto it = lower_bound(_records.begin(), _records.end(), make_pair(key, bench_value()), less_key);
+		if (it != _records.end() && it->first == key) it->second = value;
+		else _records.emplace(it, key, value);
+	}
+
+	bool lookup(bench_key key)
+	{
+		auto it = lower_bound(_records.begin(), _records.end(), make_pair(key, bench_value()), less_key);
+		if (it == _records.end() || it->first != key) return false;
+		sink = it->second;
+		return true;
+	}
+
+	size_t scan(bench_key key)
+	{
+		size_t visited = 0;
+		auto it = lower_bound(_records.begin(), _records.end(), make_pair(key, bench_value()), less_key);
+		for (; it != _records.end() && visited < scan_length; ++it, ++visited) sink = it->second;
+		return visited;
+	}
+
+	size_t blocks_loaded() const { return 0; }
+
+private:
+	vector<pair<bench_key, bench_value>> _records;
+
+	static bool less_key(const pair<bench_key, bench_value>& a, const pair<bench_key, bench_value>& b) { return a.first < b.first; }
+};
+
+template<class TAdapter, class TMake>
+void run_all(const string& name, TMake make, const workload_keys& k, size_t block_size, size_t oflow_size)
+{
+	size_t n = k.sorted.size();
+	{
+		TAdapter s = make();
+		recorder r(n);
+		size_t before = s.blocks_loaded();
+		for (auto key : k.sorted) r.run([&] { s.insert(key, key); });
+		r.print(name, "sequential_insert", block_size, oflow_size, double(s.blocks_loaded() - before));
+	}
+
+	TAdapter s = make();
+	{
+		recorder r(n);
+		size_t before = s.blocks_loaded();
+		for (auto key : k.random_order) r.run([&] { s.insert(key, key); });
+		r.print(name, "random_insert", block_size, oflow_size, double(s.blocks_loaded() - before));
+	}
+
+	auto lookups = [&](const char* workload, const vector<bench_key>& probes)
+	{
+		recorder r(probes.size());
+		size_t before = s.blocks_loaded();
+		for (auto key : probes) r.run([&] { s.lookup(key); });
+		r.print(name, workload, block_size, oflow_size, double(s.blocks_loaded() - before));
+	};
+	lookups("uniform_lookup", k.uniform);
+	lookups("zipf_lookup", k.zipf);
+	lookups("absent_lookup", k.absent);
+
+	{
+		size_t scans = n / scan_length;
+		recorder r(scans);
+		size_t before = s.blocks_loaded();
+		for (size_t i = 0; i < scans; ++i) r.run([&] { s.scan(k.uniform[i]); });
+		r.print(name, "range_scan", block_size, oflow_size, double(s.blocks_loaded() - before));
+	}
+
+	{
+		// 90 % lookups of present keys, 10 % inserts of new (odd) keys
+		recorder r(n);
+		size_t before = s.blocks_loaded();
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (k.mixed_writes[i]) r.run([&] { s.insert(k.absent[i], i); });
+			else r.run([&] { s.lookup(k.uniform[i]); });
+		}
+		r.print(name, "mixed_90_10", block_size, oflow_size, double(s.blocks_loaded() - before));
+	}
+}
+
+int main(int argc, char** argv)
+{
+	size_t n = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000;
+	workload_keys k = make_keys(n);
+
+	cout << "structure,workload,block_size,oflow_size,ops,ops_per_s,p50_ns,p99_ns,blocks_loaded_per_op" << endl;
+	run_all<map_adapter>("std::map", [] { return map_adapter(); }, k, 0, 0);
+	run_all<vector_adapter>("sorted_vector", [] { return vector_adapter(); }, k, 0, 0);
+	for (size_t block_size : { 16, 64, 256, 1024 })
+	{
+		for (size_t oflow_size : { 16, 256, 4096 })
+		{
+			run_all<isam_adapter>("isam", [&] { return isam_adapter(block_size, oflow_size); }, k, block_size, oflow_size);
+			run_all<isam_adapter>("isam+bloom", [&] { return isam_adapter(block_size, oflow_size, 10); }, k, block_size, oflow_size);
+		}
+	}
+	return 0;
+}
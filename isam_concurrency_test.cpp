@@ -0,0 +1,85 @@
+// Reader/writer stress test of isam: concurrent get() calls must always find the preloaded keys with their values,
+// and the single writer must make progress while the readers keep the latches busy.
+// Build with e.g. g++ -std=c++17 -O2 isam_concurrency_test.cpp -pthread (add -fsanitize=thread to check for races)
+// Usage: isam_concurrency_test [readers], returns 0 on success.
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+#include "isam.hpp"
+
+using namespace std;
+
+const long key_count = 20000;
+const auto writer_deadline = chrono::seconds(60);
+
+int main(int argc, char** argv)
+{
+	int readers = argc > 1 ? atoi(argv[1]) : 8;
+	int failures = 0;
+	for (bool filters : { false, true })
+	{
+		isam<long, long> index(16, 50);
+		if (filters) index.enable_filters(8);
+		for (long k = 0; k < key_count; k += 2) index.insert_or_assign(k, k * 7);
+
+		atomic<bool> stop{ false };
+		atomic<long> bad{ 0 }, lookups{ 0 };
+		vector<thread> threads;
+		for (int r = 0; r < readers; ++r)
+		{
+			threads.emplace_back([&, r]
+			{
+				mt19937 rng(r);
+				while (!stop)
+				{
+					long k = static_cast<long>(rng() % (2 * key_count)), v;
+					if (index.get(k, v))
+					{
+						if (v != k * 7) ++bad;
+					}
+					else if (k % 2 == 0 && k < key_count) ++bad; // preloaded keys are never erased
+					++lookups;
+				}
+			});
+		}
+
+		// inserts, erases and range erases that reorganize the blocks under the readers
+		auto start = chrono::steady_clock::now();
+		mt19937 rng(99);
+		bool late = false;
+		for (long i = 0; i < key_count && !late; ++i)
+		{
+			long k = static_cast<long>(rng() % (2 * key_count));
+			index.insert_or_assign(k, k * 7);
+			long e = static_cast<long>(rng() % (2 * key_count));
+			if (e % 2 == 1 || e >= key_count) index.erase(e);
+			if (i % 1000 == 0)
+			{
+				long lo = key_count + static_cast<long>(rng() % key_count);
+				index.erase(lo, lo + 50);
+			}
+			late = chrono::steady_clock::now() - start > writer_deadline;
+		}
+		stop = true;
+		for (auto& t : threads) t.join();
+
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << "filters " << filters << ": writer " << seconds << " s, lookups " << lookups << ", bad " << bad << endl;
+		if (late)
+		{
+			cout << "FAIL: the writer did not finish within the deadline" << endl;
+			++failures;
+		}
+		if (bad != 0)
+		{
+			cout << "FAIL: lookups returned wrong results" << endl;
+			++failures;
+		}
+	}
+	cout << (failures == 0 ? "OK" : "FAIL") << endl;
+	return failures == 0 ? 0 : 1;
+}
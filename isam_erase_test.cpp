@@ -0,0 +1,109 @@
+// Tests of isam::erase: after erases the blocks are merged so that none stays underfull, the records match a
+// std::map, and the freed blocks go back to the provider.
+// Build with e.g. g++ -std=c++17 -O2 isam_erase_test.cpp -pthread
+// Usage: isam_erase_test, returns 0 on success.
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include "isam.hpp"
+
+using namespace std;
+
+typedef isam<long, long> test_isam;
+
+const size_t block_size = 10; // min_fill() is 2, so underfull blocks are exactly those of fill buckets 0 and 1
+const long key_count = 10000;
+
+int failures = 0;
+
+void check(bool condition, const string& what)
+{
+	if (condition) return;
+	cout << "FAIL: " << what << endl;
+	++failures;
+}
+
+// the records in key order and by lookup are those of expected, and no block is underfull unless it is the only one
+void check_invariants(const test_isam& index, const map<long, long>& expected, const string& when)
+{
+	auto it = expected.begin();
+	bool same = true;
+	for (auto&& record : index)
+	{
+		if (it == expected.end() || it->first != record.first || it->second != record.second) same = false;
+		if (it != expected.end()) ++it;
+	}
+	check(same && it == expected.end(), when + ": the records match");
+
+	bool found = true;
+	for (long k = 0; k < key_count; k += 7)
+	{
+		long value;
+		auto record = expected.find(k);
+		if (index.get(k, value) != (record != expected.end()) || (record != expected.end() && value != record->second)) found = false;
+	}
+	check(found, when + ": lookups find the records");
+
+	isam_stats stats = index.stats();
+	check(stats.records == expected.size(), when + ": the record count matches");
+	size_t underfull = stats.fill_histogram[0] + stats.fill_histogram[1];
+	check(stats.blocks <= 1 || underfull == 0, when + ": no underfull blocks");
+}
+
+int main()
+{
+	block_provider::memory_provider provider;
+	test_isam index(block_size, 16, &provider);
+	map<long, long> expected;
+	for (long k = 0; k < key_count; ++k)
+	{
+		index.insert_or_assign(k, k * 3);
+		expected[k] = k * 3;
+	}
+	check_invariants(index, expected, "after the load");
+	size_t loaded_blocks = index.stats().blocks;
+	size_t reserved = provider.reserved_bytes();
+
+	// single erases in random order, with a few misses
+	mt19937 rng(7);
+	for (long i = 0; i < 2 * key_count; ++i)
+	{
+		long k = static_cast<long>(rng() % (key_count + 100));
+		size_t erased = index.erase(k);
+		check(erased == expected.erase(k), "erase(key) returns the number of erased records");
+		if (i % 1000 == 0) check_invariants(index, expected, "after " + to_string(i) + " erases");
+	}
+	check_invariants(index, expected, "after the single erases");
+
+	// range erases, some of them spanning many blocks
+	for (long lo = 0; lo < key_count; lo += 700)
+	{
+		long hi = lo + 1 + static_cast<long>(rng() % 400);
+		size_t erased = index.erase(lo, hi);
+		size_t removed = 0;
+		for (auto it = expected.lower_bound(lo); it != expected.end() && it->first < hi; it = expected.erase(it)) ++removed;
+		check(erased == removed, "erase(lo, hi) returns the number of erased records");
+		check_invariants(index, expected, "after erase(" + to_string(lo) + ", " + to_string(hi) + ")");
+	}
+
+	isam_stats stats = index.stats();
+	check(stats.merges > 0, "underfull blocks were merged");
+	check(stats.blocks < loaded_blocks, "the block count shrank with the records");
+
+	// everything goes, then the table fills again from the freed blocks
+	index.erase(-1, key_count + 100);
+	expected.clear();
+	check_invariants(index, expected, "after erasing everything");
+	check(index.stats().blocks == 0 && index.cbegin() == index.cend(), "an emptied isam has no blocks");
+	for (long k = 0; k < key_count; ++k)
+	{
+		index.insert_or_assign(k, k);
+		expected[k] = k;
+	}
+	check_invariants(index, expected, "after the reload");
+	check(provider.reserved_bytes() == reserved, "the reload reuses the freed blocks");
+
+	cout << (failures == 0 ? "OK" : "FAIL") << endl;
+	return failures == 0 ? 0 : 1;
+}
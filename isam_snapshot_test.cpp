@@ -0,0 +1,158 @@
+// Tests of isam::snapshot: a snapshot keeps showing the records of the time it was taken while the writer upserts
+// and erases, and a scanning thread reads it concurrently.
+// Build with e.g. g++ -std=c++17 -O2 isam_snapshot_test.cpp -pthread (add -fsanitize=thread to check for races)
+// Usage: isam_snapshot_test, returns 0 on success.
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include "isam.hpp"
+
+using namespace std;
+
+typedef isam<long, long> test_isam;
+
+const long key_count = 20000;
+
+int failures = 0;
+
+void check(bool condition, const string& what)
+{
+	if (condition) return;
+	cout << "FAIL: " << what << endl;
+	++failures;
+}
+
+// whether the snapshot holds exactly the records of expected, through a full scan and through lookups
+bool same(const test_isam::isam_snapshot& snapshot, const map<long, long>& expected, unsigned seed)
+{
+	auto it = snapshot.begin();
+	for (auto&& record : expected)
+	{
+		if (it == snapshot.end() || it->first != record.first || it->second != record.second) return false;
+		++it;
+	}
+	if (it != snapshot.end()) return false;
+
+	mt19937 rng(seed);
+	for (int i = 0; i < 200; ++i)
+	{
+		long k = static_cast<long>(rng() % (2 * key_count)), v;
+		auto found = expected.find(k);
+		if (snapshot.get(k, v) != (found != expected.end()) || (found != expected.end() && v != found->second)) return false;
+		auto first = snapshot.lower_bound(k);
+		auto expected_first = expected.lower_bound(k);
+		if ((first == snapshot.end()) != (expected_first == expected.end())) return false;
+		if (expected_first != expected.end() && first->first != expected_first->first) return false;
+	}
+	return true;
+}
+
+int main()
+{
+	test_isam index(16, 32);
+	map<long, long> expected;
+	for (long k = 0; k < 2 * key_count; k += 2) // ascending, so the overflow area stays empty
+	{
+		index.insert_or_assign(k, k);
+		expected[k] = k;
+	}
+
+	{
+		test_isam::isam_snapshot snapshot = index.snapshot();
+		check(same(snapshot, expected, 1), "a snapshot holds the records at its creation");
+
+		// the reader scans the snapshot until the writer is done
+		atomic<bool> stop{ false };
+		atomic<long> scans{ 0 }, mismatches{ 0 };
+		thread reader([&]
+		{
+			unsigned seed = 2;
+			do
+			{
+				if (!same(snapshot, expected, seed++)) ++mismatches;
+				++scans;
+			} while (!stop);
+		});
+
+		// upserts of present and absent keys, single and range erases
+		map<long, long> current = expected;
+		mt19937 rng(3);
+		for (long i = 0; i < key_count; ++i)
+		{
+			long k = static_cast<long>(rng() % (2 * key_count));
+			index.insert_or_assign(k, -k);
+			current[k] = -k;
+			if (i % 4 == 0)
+			{
+				long e = static_cast<long>(rng() % (2 * key_count));
+				index.erase(e);
+				current.erase(e);
+			}
+			if (i % 1000 == 0)
+			{
+				long lo = static_cast<long>(rng() % (2 * key_count));
+				index.erase(lo, lo + 100);
+				current.erase(current.lower_bound(lo), current.lower_bound(lo + 100));
+			}
+		}
+		stop = true;
+		reader.join();
+
+		check(scans > 0 && mismatches == 0, "the snapshot stays unchanged while the writer upserts");
+		check(same(snapshot, expected, 4), "the snapshot is unchanged after the writes");
+		check(index.stats().block_copies > 0, "the writer copied the blocks shared with the snapshot");
+
+		test_isam::isam_snapshot later = index.snapshot();
+		check(same(later, current, 5), "a later snapshot holds the later records");
+		expected.swap(current);
+
+		// values written through iterators go to copies of the blocks the later snapshot shares
+		current = expected;
+		stop = false;
+		scans = 0;
+		thread iterator_reader([&]
+		{
+			unsigned seed = 6;
+			do
+			{
+				if (!same(later, expected, seed++)) ++mismatches;
+				++scans;
+			} while (!stop);
+		});
+		for (long k = 0; k < 2 * key_count; k += 97)
+		{
+			auto found = index.find(k);
+			if (found == index.end()) continue;
+			found->second = 999;
+			current[k] = 999;
+		}
+		long written = 0;
+		for (auto it = index.lower_bound(key_count); it != index.end() && written < 500; ++it, ++written)
+		{
+			it->second = 777;
+			current[it->first] = 777;
+		}
+		stop = true;
+		iterator_reader.join();
+
+		check(scans > 0 && mismatches == 0, "the snapshot stays unchanged while values are written through iterators");
+		check(same(later, expected, 7), "the snapshot is unchanged after the writes through iterators");
+		expected.swap(current);
+	}
+
+	// with the snapshots released the isam itself holds the latest records
+	auto it = expected.begin();
+	bool matches = true;
+	for (auto&& record : index)
+	{
+		if (it == expected.end() || it->first != record.first || it->second != record.second) matches = false;
+		if (it != expected.end()) ++it;
+	}
+	check(matches && it == expected.end(), "the isam holds the latest records");
+
+	cout << (failures == 0 ? "OK" : "FAIL") << endl;
+	return failures == 0 ? 0 : 1;
+}
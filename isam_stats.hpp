@@ -0,0 +1,137 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include "block_provider.hpp"
+
+// Per-instance statistics of an isam, see isam::stats().
+// The counters are relaxed atomics bumped on the hot paths. Defining ISAM_NO_STATS turns them into empty no-ops,
+// defining ISAM_LATENCY_STATS additionally times every lookup and insert.
+
+// snapshot returned by isam::stats()
+struct isam_stats
+{
+	static const size_t fill_buckets = 10;
+	static const size_t latency_buckets = 32;
+
+	size_t oflow_hits = 0, oflow_misses = 0; // lookups answered / not answered by the overflow area
+	size_t block_loads = 0; // blocks loaded from the provider by lookups, inserts and reorganizations
+	size_t block_switches = 0; // changes of the writer's current block
+	size_t oflow_pushes = 0; // reorganizations (push_oflow)
+	size_t oflow_push_ns = 0, oflow_push_max_ns = 0; // total and longest reorganization
+	size_t splits = 0; // blocks added by splitting full blocks
+	size_t shift_bytes = 0; // bytes moved to make room for inserted records
+	size_t merges = 0; // blocks freed by merging underfull blocks after erase
+	size_t filter_skips = 0; // lookups of absent keys answered by the Bloom filters without loading a block
+	size_t filter_false_positives = 0; // blocks loaded because of their filter, without the key
+	size_t block_copies = 0; // blocks copied on write because a snapshot shares them
+
+	size_t blocks = 0, records = 0, oflow_records = 0;
+	size_t filter_bytes = 0; // memory of the Bloom filters (see isam::enable_filters())
+	// blocks by fill factor, bucket i holds blocks filled to [i / 10, (i + 1) / 10), full blocks are in the last one
+	std::array<size_t, fill_buckets> fill_histogram{};
+	// operations by latency, bucket i holds those that took [2^i, 2^(i+1)) ns (only with ISAM_LATENCY_STATS)
+	std::array<size_t, latency_buckets> lookup_latency{};
+	std::array<size_t, latency_buckets> insert_latency{};
+
+	block_provider::provider_stats provider; // of the whole provider, which may be shared
+};
+
+namespace isam_impl
+{
+#ifndef ISAM_NO_STATS
+	class stat_counter
+	{
+	public:
+		void add(size_t n = 1) { _value.fetch_add(n, std::memory_order_relaxed); }
+		void set_max(size_t n)
+		{
+			size_t current = _value.load(std::memory_order_relaxed);
+			while (current < n && !_value.compare_exchange_weak(current, n, std::memory_order_relaxed)) {}
+		}
+		size_t load() const { return _value.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<size_t> _value{ 0 };
+	};
+#else
+	class stat_counter
+	{
+	public:
+		void add(size_t = 1) {}
+		void set_max(size_t) {}
+		size_t load() const { return 0; }
+	};
+#endif
+
+	class latency_histogram
+	{
+	public:
+#if defined(ISAM_LATENCY_STATS) && !defined(ISAM_NO_STATS)
+		void record(size_t ns)
+		{
+			size_t bucket = 0;
+			while (ns > 1 && bucket + 1 < isam_stats::latency_buckets) { ns >>= 1; ++bucket; }
+			_buckets[bucket].add();
+		}
+
+		void copy_to(std::array<size_t, isam_stats::latency_buckets>& out) const
+		{
+			for (size_t i = 0; i < out.size(); ++i) out[i] = _buckets[i].load();
+		}
+
+	private:
+		std::array<stat_counter, isam_stats::latency_buckets> _buckets;
+#else
+		void copy_to(std::array<size_t, isam_stats::latency_buckets>&) const {}
+#endif
+	};
+
+	// measures the lifetime of a scope
+	class stat_timer
+	{
+	public:
+#ifndef ISAM_NO_STATS
+		stat_timer() : _start(std::chrono::steady_clock::now()) {}
+
+		size_t elapsed_ns() const
+		{
+			return static_cast<size_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count());
+		}
+
+	private:
+		std::chrono::steady_clock::time_point _start;
+#else
+		size_t elapsed_ns() const { return 0; }
+#endif
+	};
+
+	// adds the lifetime of a scope to a latency histogram
+	class latency_timer
+	{
+	public:
+#if defined(ISAM_LATENCY_STATS) && !defined(ISAM_NO_STATS)
+		explicit latency_timer(latency_histogram& histogram) : _histogram(histogram) {}
+		~latency_timer() { _histogram.record(_timer.elapsed_ns()); }
+
+	private:
+		latency_histogram& _histogram;
+		stat_timer _timer;
+#else
+		explicit latency_timer(latency_histogram&) {}
+#endif
+	};
+
+	// counters of one isam
+	struct isam_counters
+	{
+		stat_counter oflow_hits, oflow_misses;
+		stat_counter block_loads, block_switches;
+		stat_counter oflow_pushes, oflow_push_ns, oflow_push_max_ns;
+		stat_counter splits, shift_bytes, merges;
+		stat_counter filter_skips, filter_false_positives;
+		stat_counter block_copies;
+		latency_histogram lookup_latency, insert_latency;
+	};
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+#include <vector>
+
+namespace isam_impl
+{
+	// keys that key_hash() can hash: those with a std::hash, or plain bytes without padding
+	template<class TKey>
+	constexpr bool filterable_key()
+	{
+		return std::is_default_constructible<std::hash<TKey>>::value || std::has_unique_object_representations<TKey>::value;
+	}
+
+	// 64-bit hash of a key for the Bloom filters, std::hash is mixed, as it is the identity for integers
+	template<class TKey>
+	uint64_t key_hash(const TKey& key)
+	{
+		uint64_t h = 0;
+		if constexpr (std::is_default_constructible<std::hash<TKey>>::value)
+		{
+			h = std::hash<TKey>()(key);
+		}
+		else if constexpr (std::has_unique_object_representations<TKey>::value)
+		{
+			unsigned char bytes[sizeof(TKey)];
+			std::memcpy(bytes, &key, sizeof(TKey));
+			h = 14695981039346656037ull; // FNV-1a
+			for (unsigned char b : bytes) h = (h ^ b) * 1099511628211ull;
+		}
+		// murmur3 finalizer
+		h ^= h >> 33; h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	// Bloom filter over key hashes: may_contain() is false only for keys that were never added.
+	// Probes are derived from one hash by double hashing, bits_per_key = 10 gives about 1 % false positives.
+	class bloom_filter
+	{
+	public:
+		bloom_filter() = default;
+
+		bloom_filter(size_t keys, size_t bits_per_key)
+		{
+			size_t bits = (keys == 0 ? 1 : keys) * bits_per_key;
+			_words.assign((bits + 63) / 64, 0);
+			_bits = _words.size() * 64;
+			_probes = static_cast<unsigned>(bits_per_key * 69 / 100); // ln 2 * bits_per_key minimizes false positives
+			if (_probes < 1) _probes = 1;
+			if (_probes > 16) _probes = 16;
+		}
+
+		void add(uint64_t hash)
+		{
+			uint32_t h = static_cast<uint32_t>(hash), step = static_cast<uint32_t>(hash >> 32) | 1;
+			for (unsigned i = 0; i < _probes; ++i, h += step)
+			{
+				size_t bit = bit_of(h);
+				_words[bit / 64] |= uint64_t(1) << (bit % 64);
+			}
+		}
+
+		bool may_contain(uint64_t hash) const
+		{
+			uint32_t h = static_cast<uint32_t>(hash), step = static_cast<uint32_t>(hash >> 32) | 1;
+			for (unsigned i = 0; i < _probes; ++i, h += step)
+			{
+				size_t bit = bit_of(h);
+				if ((_words[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) return false;
+			}
+			return true;
+		}
+
+		// forgets all keys, the storage is kept
+		void clear() { std::fill(_words.begin(), _words.end(), 0); }
+
+		size_t bytes() const { return _words.size() * sizeof(uint64_t); }
+
+	private:
+		std::vector<uint64_t> _words;
+		size_t _bits = 0;
+		unsigned _probes = 0;
+
+		// maps h onto [0, _bits) without a division
+		size_t bit_of(uint32_t h) const
+		{
+			return static_cast<size_t>((static_cast<uint64_t>(h) * _bits) >> 32);
+		}
+	};
+}
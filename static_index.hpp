@@ -0,0 +1,197 @@
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "block_search.hpp"
+
+namespace isam_impl
+{
+	// Static multi-level index over the blocks of the primary file.
+	// The leaf level holds the maximum key of every block (contiguous, so it can be searched with the SIMD kernels)
+	// next to the block IDs. Every upper level holds the maximum key of each group of fanout entries of the level
+	// below, up to a root of at most fanout keys. A lookup therefore reads one node of a couple of cache lines per
+	// level instead of chasing tree pointers. The index is not updated record by record, it is rebuilt in one pass
+	// whenever the primary file is reorganized (push_back + build). A block added or removed in the middle rebuilds
+	// only the entries of the upper levels from its position on, a block appended above every maximum (append) only
+	// the right edge of the levels.
+	template<class TKey>
+	class static_index
+	{
+	public:
+		// keys per node: two 64-byte cache lines
+		static constexpr size_t fanout = 128 / sizeof(TKey) < 4 ? 4 : 128 / sizeof(TKey);
+
+		size_t size() const { return _keys.size(); }
+		bool empty() const { return _keys.empty(); }
+
+		const TKey& key(size_t pos) const { return _keys[pos]; }
+		size_t id(size_t pos) const { return _ids[pos]; }
+
+		// position of the first block whose maximum is not smaller than key, size() if there is none
+		size_t lower_bound(const TKey& key) const
+		{
+			if (_keys.empty()) return 0;
+			size_t node = 0;
+			for (size_t l = _levels.size(); l-- > 0; )
+			{
+				const std::vector<TKey>& level = _levels[l];
+				size_t child = node * fanout + search_node(level, node, key);
+				if (child == level.size()) return _keys.size(); // above every maximum, only possible at the root
+				node = child;
+			}
+			return node * fanout + search_node(_keys, node, key);
+		}
+
+		// changes the maximum of the block at pos, the order of the maximums must not change
+		void set_key(size_t pos, const TKey& key)
+		{
+			_keys[pos] = key;
+			size_t count = _keys.size();
+			for (auto&& level : _levels)
+			{
+				if ((pos + 1) % fanout != 0 && pos + 1 != count) return; // not the maximum of its node
+				pos /= fanout;
+				level[pos] = key;
+				count = level.size();
+			}
+		}
+
+		// replaces the block at pos by another one with the same maximum (a copy of it)
+		void set_id(size_t pos, size_t block_id)
+		{
+			_ids[pos] = block_id;
+		}
+
+		// adds a block before pos (a split), the upper levels are rebuilt from pos on
+		void insert(size_t pos, const TKey& key, size_t block_id)
+		{
+			_keys.insert(_keys.begin() + pos, key);
+			_ids.insert(_ids.begin() + pos, block_id);
+			build_from(pos);
+		}
+
+		// removes the block at pos, the upper levels are rebuilt from pos on
+		void erase(size_t pos)
+		{
+			erase(pos, pos + 1);
+		}
+
+		// removes the blocks [first, last), the upper levels are rebuilt from first on
+		void erase(size_t first, size_t last)
+		{
+			if (first == last) return;
+			_keys.erase(_keys.begin() + first, _keys.begin() + last);
+			_ids.erase(_ids.begin() + first, _ids.begin() + last);
+			build_from(first);
+		}
+
+		// removes the blocks among [first, last) for which drop(pos) holds, called once per position in order, in one
+		// pass, the upper levels are rebuilt once from first on; returns the number of removed blocks
+		template<class TDrop>
+		size_t erase_if(size_t first, size_t last, TDrop drop)
+		{
+			size_t kept = first;
+			for (size_t pos = first; pos < last; ++pos)
+			{
+				if (drop(pos)) continue;
+				if (kept != pos)
+				{
+					_keys[kept] = std::move(_keys[pos]);
+					_ids[kept] = _ids[pos];
+				}
+				++kept;
+			}
+			if (kept == last) return 0;
+			_keys.erase(_keys.begin() + kept, _keys.begin() + last);
+			_ids.erase(_ids.begin() + kept, _ids.begin() + last);
+			build_from(first); // the kept blocks moved down from first on
+			return last - kept;
+		}
+
+		void reserve(size_t count)
+		{
+			_keys.reserve(count);
+			_ids.reserve(count);
+		}
+
+		// appends a block, maximums must be pushed in ascending order and build() called before the next lookup
+		void push_back(const TKey& key, size_t block_id)
+		{
+			_keys.push_back(key);
+			_ids.push_back(block_id);
+		}
+
+		// appends a block whose maximum is above every other one, keeping the upper levels valid without a rebuild:
+		// the key becomes the last entry of every level, a new root is added once the old one outgrows a node
+		void append(const TKey& key, size_t block_id)
+		{
+			push_back(key, block_id);
+			for (size_t depth = 0; (depth == 0 ? _keys : _levels[depth - 1]).size() > fanout; ++depth)
+			{
+				if (_levels.size() == depth) _levels.emplace_back();
+				const std::vector<TKey>& below = depth == 0 ? _keys : _levels[depth - 1];
+				std::vector<TKey>& level = _levels[depth];
+				size_t nodes = (below.size() + fanout - 1) / fanout;
+				while (level.size() + 1 < nodes) level.push_back(below[(level.size() + 1) * fanout - 1]); // only for a new root
+				if (level.size() < nodes) level.push_back(key);
+				else level.back() = key;
+			}
+		}
+
+		// builds the upper levels above the leaves
+		void build()
+		{
+			build_from(0);
+		}
+
+		void clear()
+		{
+			_keys.clear();
+			_ids.clear();
+			_levels.clear();
+		}
+
+		void swap(static_index& other)
+		{
+			_keys.swap(other._keys);
+			_ids.swap(other._ids);
+			_levels.swap(other._levels);
+		}
+
+	private:
+		// rebuilds the entries of the upper levels above the leaves from pos on (pos at most the old leaf count),
+		// the entries before cover unchanged leaves
+		// the levels are overwritten in place, so that keys that own memory (strings) keep it across rebuilds
+		void build_from(size_t pos)
+		{
+			size_t depth = 0;
+			while ((depth == 0 ? _keys : _levels[depth - 1]).size() > fanout)
+			{
+				if (_levels.size() == depth) _levels.emplace_back();
+				const std::vector<TKey>& below = depth == 0 ? _keys : _levels[depth - 1];
+				std::vector<TKey>& level = _levels[depth++];
+				size_t first = pos / fanout < level.size() ? pos / fanout : level.size();
+				level.resize((below.size() + fanout - 1) / fanout);
+				for (size_t j = first; j < level.size(); ++j)
+				{
+					size_t i = (j + 1) * fanout - 1;
+					level[j] = below[i < below.size() ? i : below.size() - 1];
+				}
+				pos = first;
+			}
+			_levels.resize(depth);
+		}
+
+		std::vector<TKey> _keys; // maximum key of every block, in chain order
+		std::vector<size_t> _ids; // block IDs, parallel to _keys
+		std::vector<std::vector<TKey>> _levels; // _levels[0] is right above the leaves, the last one is the root
+
+		// position within the node-th node of the level of the first key that is not smaller than key
+		static size_t search_node(const std::vector<TKey>& level, size_t node, const TKey& key)
+		{
+			size_t first = node * fanout;
+			size_t count = level.size() - first < fanout ? level.size() - first : fanout;
+			return lower_bound_keys<TKey, sizeof(TKey)>(level.data() + first, count, key);
+		}
+	};
+}
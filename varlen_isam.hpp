@@ -0,0 +1,532 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "block_provider.hpp"
+#include "static_index.hpp"
+
+namespace isam_impl
+{
+	// View of a slotted page, the block format for records of variable length:
+	// 1x 8b - count of records
+	// 1x 8b - ID of next block
+	// 1x 4b - start of the heap, which grows down from the end of the block
+	// 1x 4b - dead heap bytes, left behind by erased and shrunk records
+	// count x 12b - slot directory in key order: offset of the record in the block, key size, value size
+	// free space, then the heap with the key bytes of every record followed by its value bytes
+	// Inserts and erases shift slots only, the heap is compacted when a record fits into the free space together
+	// with the dead bytes but not into the free space alone.
+	class slotted_page
+	{
+	public:
+		struct slot
+		{
+			uint32_t offset, key_size, value_size;
+		};
+
+		static const size_t header_size = 24;
+
+		// bytes a record takes in a page, with its slot
+		static size_t record_bytes(std::string_view key, std::string_view value)
+		{
+			return sizeof(slot) + key.size() + value.size();
+		}
+
+		slotted_page(void* block, size_t page_size) : _data(static_cast<char*>(block)), _page_size(page_size) {}
+
+		void* data() const { return _data; }
+
+		// removes every record, the next block is kept
+		void clear()
+		{
+			set_count(0);
+			set_heap(_page_size);
+			set_dead(0);
+		}
+
+		size_t count() const { return load<uint64_t>(0); }
+		size_t next() const { return load<uint64_t>(8); }
+		void set_next(size_t next) { store<uint64_t>(8, next); }
+
+		std::string_view key(size_t i) const
+		{
+			slot s = slot_at(i);
+			return std::string_view(_data + s.offset, s.key_size);
+		}
+
+		std::string_view value(size_t i) const
+		{
+			slot s = slot_at(i);
+			return std::string_view(_data + s.offset + s.key_size, s.value_size);
+		}
+
+		// position of the first record whose key is not smaller than key
+		size_t lower_bound(std::string_view key) const
+		{
+			size_t first = 0, count = this->count();
+			while (count > 0)
+			{
+				size_t half = count / 2;
+				if (this->key(first + half) < key)
+				{
+					first += half + 1;
+					count -= half + 1;
+				}
+				else count = half;
+			}
+			return first;
+		}
+
+		// bytes of the live records with their slots, at most capacity_bytes()
+		size_t used_bytes() const { return count() * sizeof(slot) + _page_size - heap() - dead(); }
+		size_t capacity_bytes() const { return _page_size - header_size; }
+
+		// Inserts a record at position i, the caller keeps the keys sorted. Returns false if the record does not fit.
+		// key and value must not point into the page.
+		bool insert(size_t i, std::string_view key, std::string_view value)
+		{
+			size_t bytes = record_bytes(key, value);
+			if (free_bytes() < bytes)
+			{
+				if (free_bytes() + dead() < bytes) return false;
+				compact();
+			}
+			size_t count = this->count();
+			size_t heap = this->heap() - key.size() - value.size();
+			std::memcpy(_data + heap, key.data(), key.size());
+			std::memcpy(_data + heap + key.size(), value.data(), value.size());
+			char* slots = _data + header_size;
+			std::memmove(slots + (i + 1) * sizeof(slot), slots + i * sizeof(slot), (count - i) * sizeof(slot));
+			set_slot(i, slot{ static_cast<uint32_t>(heap), static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size()) });
+			set_heap(heap);
+			set_count(count + 1);
+			return true;
+		}
+
+		// Replaces the value of the record at i, in place if it is not larger. Returns false if a larger value does
+		// not fit into the free space, then the record is unchanged. value must not point into the page.
+		bool assign(size_t i, std::string_view value)
+		{
+			slot s = slot_at(i);
+			if (value.size() <= s.value_size)
+			{
+				std::memcpy(_data + s.offset + s.key_size, value.data(), value.size());
+				set_dead(dead() + s.value_size - value.size());
+				s.value_size = static_cast<uint32_t>(value.size());
+				set_slot(i, s);
+				return true;
+			}
+			size_t bytes = s.key_size + value.size();
+			if (free_bytes() < bytes) return false;
+			size_t heap = this->heap() - bytes; // the record moves to the heap top, its old bytes are dead
+			std::memcpy(_data + heap, _data + s.offset, s.key_size);
+			std::memcpy(_data + heap + s.key_size, value.data(), value.size());
+			set_dead(dead() + s.key_size + s.value_size);
+			set_slot(i, slot{ static_cast<uint32_t>(heap), s.key_size, static_cast<uint32_t>(value.size()) });
+			set_heap(heap);
+			return true;
+		}
+
+		void erase(size_t i)
+		{
+			slot s = slot_at(i);
+			size_t count = this->count();
+			char* slots = _data + header_size;
+			std::memmove(slots + i * sizeof(slot), slots + (i + 1) * sizeof(slot), (count - i - 1) * sizeof(slot));
+			set_count(count - 1);
+			if (count == 1) clear();
+			else set_dead(dead() + s.key_size + s.value_size);
+		}
+
+		// packs the live records at the end of the page, so that the dead bytes become free space
+		void compact()
+		{
+			size_t count = this->count();
+			std::vector<uint32_t> order(count); // slots by descending offset: every record moves up, over dead bytes
+			std::iota(order.begin(), order.end(), 0);
+			std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return slot_at(a).offset > slot_at(b).offset; });
+			size_t heap = _page_size;
+			for (uint32_t i : order)
+			{
+				slot s = slot_at(i);
+				heap -= s.key_size + s.value_size;
+				std::memmove(_data + heap, _data + s.offset, s.key_size + s.value_size);
+				s.offset = static_cast<uint32_t>(heap);
+				set_slot(i, s);
+			}
+			set_heap(heap);
+			set_dead(0);
+		}
+
+	private:
+		char* _data;
+		size_t _page_size;
+
+		template<class T>
+		T load(size_t offset) const
+		{
+			T result;
+			std::memcpy(&result, _data + offset, sizeof(T));
+			return result;
+		}
+
+		template<class T>
+		void store(size_t offset, T value)
+		{
+			std::memcpy(_data + offset, &value, sizeof(T));
+		}
+
+		void set_count(size_t count) { store<uint64_t>(0, count); }
+		size_t heap() const { return load<uint32_t>(16); }
+		void set_heap(size_t heap) { store<uint32_t>(16, static_cast<uint32_t>(heap)); }
+		size_t dead() const { return load<uint32_t>(20); }
+		void set_dead(size_t dead) { store<uint32_t>(20, static_cast<uint32_t>(dead)); }
+		size_t free_bytes() const { return heap() - header_size - count() * sizeof(slot); }
+
+		slot slot_at(size_t i) const { return load<slot>(header_size + i * sizeof(slot)); }
+		void set_slot(size_t i, slot s) { store<slot>(header_size + i * sizeof(slot), s); }
+	};
+}
+
+// Ordered map of byte strings (keys and values of variable length), kept in slotted pages (see
+// isam_impl::slotted_page) instead of fixed-size records, so that strings need neither a heap allocation of their
+// own nor pointers to them. Records go straight into their block: a full block is split into two that hold about
+// the same number of bytes, a block left less than a quarter full by erase is merged with a neighbour when both fit
+// into one block. Blocks are found through a static_index of their maximum keys. Iterators return views of the
+// keys and values in the blocks, which are valid until the next modification. A record (key, value and its slot)
+// may take at most half of a block. Not thread-safe.
+class varlen_isam
+{
+public:
+	// block_size in bytes, blocks are kept in the given provider or in a memory_provider of its own
+	explicit varlen_isam(size_t block_size, block_provider::provider* provider = nullptr)
+		: _own_provider(provider == nullptr ? new block_provider::memory_provider() : nullptr),
+		_provider(provider == nullptr ? _own_provider.get() : provider)
+	{
+		_page_size = _provider->aligned_block_size(block_size);
+		if (_page_size < 4 * isam_impl::slotted_page::header_size || _page_size > UINT32_MAX) throw std::invalid_argument("varlen_isam: invalid block size");
+		_scratch.resize(_page_size);
+	}
+
+	varlen_isam(const varlen_isam&) = delete;
+	varlen_isam& operator=(const varlen_isam&) = delete;
+
+	~varlen_isam()
+	{
+		if (_own_provider) return; // goes with the table, blocks and all
+		for (size_t pos = 0; pos < _index.size(); ++pos) _provider->free_block(_index.id(pos)); // a shared provider outlives it
+	}
+
+	class varlen_iter
+	{
+	public:
+		typedef varlen_iter self_type;
+		typedef std::pair<std::string_view, std::string_view> value_type;
+		typedef value_type reference; // views into the block
+		struct pointer
+		{
+			value_type record;
+			const value_type* operator->() const { return &record; }
+		};
+		typedef std::forward_iterator_tag iterator_category;
+		typedef ptrdiff_t difference_type;
+
+		varlen_iter() = default;
+
+		varlen_iter(const varlen_iter& i) : _owner(i._owner)
+		{
+			enter(i._block_pos);
+			_index_in_block = i._index_in_block;
+		}
+
+		varlen_iter& operator=(const varlen_iter& i)
+		{
+			if (this == &i) return *this;
+			leave();
+			_owner = i._owner;
+			enter(i._block_pos);
+			_index_in_block = i._index_in_block;
+			return *this;
+		}
+
+		~varlen_iter()
+		{
+			leave();
+		}
+
+		varlen_iter& operator++()
+		{
+			if (++_index_in_block == _count) enter(_block_pos + 1);
+			return *this;
+		}
+
+		varlen_iter operator++(int) // postfix variant
+		{
+			varlen_iter result(*this);
+			++(*this);
+			return result;
+		}
+
+		bool operator ==(const varlen_iter& b) const
+		{
+			return _block_pos == b._block_pos && _index_in_block == b._index_in_block;
+		}
+
+		bool operator !=(const varlen_iter& b) const
+		{
+			return !operator==(b);
+		}
+
+		reference operator *() const
+		{
+			return reference{ page().key(_index_in_block), page().value(_index_in_block) };
+		}
+
+		pointer operator ->() const
+		{
+			return pointer{ operator*() };
+		}
+
+	private:
+		friend class varlen_isam;
+
+		const varlen_isam* _owner = nullptr;
+		size_t _block_pos = 0; // in the index, its size at the end
+		size_t _index_in_block = 0;
+		void* _data = nullptr; // the loaded block at _block_pos
+		size_t _count = 0;
+
+		varlen_iter(const varlen_isam* owner, size_t block_pos) : _owner(owner)
+		{
+			enter(block_pos);
+		}
+
+		isam_impl::slotted_page page() const { return isam_impl::slotted_page(_data, _owner->_page_size); }
+
+		// loads the block at pos, blocks are never empty
+		void enter(size_t pos)
+		{
+			leave();
+			_block_pos = pos;
+			_index_in_block = 0;
+			if (_owner == nullptr || pos >= _owner->_index.size()) return;
+			_data = _owner->_provider->load_block(_owner->_index.id(pos));
+			_count = page().count();
+		}
+
+		void leave()
+		{
+			if (_data == nullptr) return;
+			_owner->_provider->release_block(_owner->_index.id(_block_pos));
+			_data = nullptr;
+			_count = 0;
+		}
+	};
+
+	varlen_iter begin() const { return varlen_iter(this, 0); }
+	varlen_iter end() const { return varlen_iter(this, _index.size()); }
+
+	// iterator at the first record whose key is not smaller than key
+	varlen_iter lower_bound(std::string_view key) const
+	{
+		varlen_iter result(this, _index.lower_bound(probe(key)));
+		if (result._data == nullptr) return result;
+		result._index_in_block = result.page().lower_bound(key);
+		if (result._index_in_block == result._count) result.enter(result._block_pos + 1);
+		return result;
+	}
+
+	varlen_iter find(std::string_view key) const
+	{
+		varlen_iter result = lower_bound(key);
+		if (result != end() && (*result).first == key) return result;
+		return end();
+	}
+
+	bool contains(std::string_view key) const
+	{
+		return find(key) != end();
+	}
+
+	// copies the value of key into out, returns false if the key is not present
+	bool get(std::string_view key, std::string& out) const
+	{
+		size_t pos = _index.lower_bound(probe(key));
+		if (pos == _index.size()) return false;
+		size_t block_id = _index.id(pos);
+		isam_impl::slotted_page page(_provider->load_block(block_id), _page_size);
+		size_t i = page.lower_bound(key);
+		bool found = i < page.count() && page.key(i) == key;
+		if (found) out.assign(page.value(i));
+		_provider->release_block(block_id);
+		return found;
+	}
+
+	// inserts the record or replaces the value of key, returns true if the key was inserted
+	bool insert_or_assign(std::string_view key, std::string_view value)
+	{
+		if (isam_impl::slotted_page::record_bytes(key, value) > max_record_bytes()) throw std::length_error("varlen_isam: record larger than half a block");
+		if (_index.empty())
+		{
+			size_t block_id = _provider->create_block(_page_size);
+			isam_impl::slotted_page page(_provider->load_block(block_id), _page_size);
+			page.clear();
+			page.insert(0, key, value);
+			_provider->store_block(block_id);
+			_index.push_back(std::string(key), block_id);
+			_index.build();
+			_count = 1;
+			return true;
+		}
+
+		size_t pos = _index.lower_bound(probe(key));
+		if (pos == _index.size()) --pos; // above every key, goes to the last block
+		size_t block_id = _index.id(pos);
+		isam_impl::slotted_page page(_provider->load_block(block_id), _page_size);
+		size_t i = page.lower_bound(key);
+		bool found = i < page.count() && page.key(i) == key;
+		if (found)
+		{
+			if (page.assign(i, value))
+			{
+				_provider->store_block(block_id);
+				return false;
+			}
+			page.erase(i); // inserted anew below
+		}
+		else ++_count;
+
+		if (page.insert(i, key, value))
+		{
+			if (_index.key(pos) < key) _index.set_key(pos, std::string(key));
+			_provider->store_block(block_id);
+		}
+		else split(pos, page, i, key, value);
+		return !found;
+	}
+
+	// removes key, returns the number of removed records (0 or 1), iterators are invalidated
+	size_t erase(std::string_view key)
+	{
+		size_t pos = _index.lower_bound(probe(key));
+		if (pos == _index.size()) return 0;
+		size_t block_id = _index.id(pos);
+		isam_impl::slotted_page page(_provider->load_block(block_id), _page_size);
+		size_t i = page.lower_bound(key);
+		if (i == page.count() || page.key(i) != key)
+		{
+			_provider->release_block(block_id);
+			return 0;
+		}
+		page.erase(i);
+		--_count;
+		size_t used = page.used_bytes();
+		_provider->store_block(block_id);
+		if (_count == 0)
+		{
+			_provider->free_block(block_id);
+			_index.clear();
+		}
+		else if (used < page.capacity_bytes() / 4 && _index.size() > 1) merge(pos + 1 < _index.size() ? pos : pos - 1);
+		return 1;
+	}
+
+	size_t size() const { return _count; }
+	bool empty() const { return _count == 0; }
+	size_t blocks() const { return _index.size(); }
+
+private:
+	std::unique_ptr<block_provider::provider> _own_provider; // set when no provider was passed in
+	block_provider::provider* _provider;
+	size_t _page_size;
+	isam_impl::static_index<std::string> _index; // maximum key of every block, may be above its largest key after erase
+	size_t _count = 0;
+	std::vector<char> _scratch; // a copy of the block being split
+	mutable std::string _probe; // the key of a lookup, as the index takes it
+
+	const std::string& probe(std::string_view key) const
+	{
+		_probe.assign(key);
+		return _probe;
+	}
+
+	size_t max_record_bytes() const { return (_page_size - isam_impl::slotted_page::header_size) / 2; }
+
+	// Splits the full block at pos (page) while inserting (key, value) at i: the records are divided where the bytes
+	// of both halves are closest, the upper half moves to a new block linked behind it.
+	void split(size_t pos, isam_impl::slotted_page& page, size_t i, std::string_view key, std::string_view value)
+	{
+		std::memcpy(_scratch.data(), page.data(), _page_size);
+		isam_impl::slotted_page old(_scratch.data(), _page_size);
+		size_t count = old.count() + 1;
+		auto record = [&](size_t j)
+		{
+			if (j == i) return std::make_pair(key, value);
+			size_t k = j < i ? j : j - 1;
+			return std::make_pair(old.key(k), old.value(k));
+		};
+
+		size_t total = old.used_bytes() + isam_impl::slotted_page::record_bytes(key, value);
+		size_t cut = 1, best = SIZE_MAX, left = 0;
+		for (size_t j = 1; j < count; ++j) // records [0, j) stay
+		{
+			auto r = record(j - 1);
+			left += isam_impl::slotted_page::record_bytes(r.first, r.second);
+			size_t difference = 2 * left > total ? 2 * left - total : total - 2 * left;
+			if (difference < best)
+			{
+				best = difference;
+				cut = j;
+			}
+		}
+
+		size_t right_id = _provider->create_block(_page_size);
+		isam_impl::slotted_page right(_provider->load_block(right_id), _page_size);
+		right.clear();
+		right.set_next(old.next());
+		page.clear();
+		page.set_next(right_id);
+		for (size_t j = 0; j < count; ++j)
+		{
+			auto r = record(j);
+			if (j < cut) page.insert(j, r.first, r.second);
+			else right.insert(j - cut, r.first, r.second);
+		}
+		std::string right_max = _index.key(pos) < key ? std::string(key) : _index.key(pos);
+		_index.set_key(pos, std::string(page.key(cut - 1)));
+		if (pos + 1 == _index.size()) _index.append(right_max, right_id); // ascending inserts split the last block
+		else _index.insert(pos + 1, right_max, right_id);
+		_provider->store_block(right_id);
+		_provider->store_block(_index.id(pos));
+	}
+
+	// moves the records of the block at left_pos + 1 into the block at left_pos if they fit, or frees an empty block
+	void merge(size_t left_pos)
+	{
+		size_t left_id = _index.id(left_pos), right_id = _index.id(left_pos + 1);
+		isam_impl::slotted_page left(_provider->load_block(left_id), _page_size);
+		isam_impl::slotted_page right(_provider->load_block(right_id), _page_size);
+		if (left.used_bytes() + right.used_bytes() > left.capacity_bytes())
+		{
+			_provider->release_block(right_id);
+			_provider->release_block(left_id);
+			return;
+		}
+		for (size_t j = 0; j < right.count(); ++j) left.insert(left.count(), right.key(j), right.value(j));
+		left.set_next(right.next());
+		_index.set_key(left_pos, _index.key(left_pos + 1));
+		_index.erase(left_pos + 1);
+		_provider->release_block(right_id);
+		_provider->free_block(right_id);
+		_provider->store_block(left_id);
+	}
+};
@@ -0,0 +1,80 @@
+// Tests of varlen_isam: the records match a std::map through splits and merges, and a table on a shared provider
+// gives its blocks back when it is destroyed.
+// Build with e.g. g++ -std=c++17 -O2 varlen_isam_test.cpp
+// Usage: varlen_isam_test, returns 0 on success.
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include "varlen_isam.hpp"
+
+using namespace std;
+
+int failures = 0;
+
+void check(bool condition, const string& what)
+{
+	if (condition) return;
+	cout << "FAIL: " << what << endl;
+	++failures;
+}
+
+string random_string(mt19937& rng, size_t max_length)
+{
+	string result(rng() % max_length, ' ');
+	for (auto& c : result) c = static_cast<char>('a' + rng() % 26);
+	return result;
+}
+
+bool same(const varlen_isam& table, const map<string, string>& expected)
+{
+	if (table.size() != expected.size()) return false;
+	auto it = table.begin();
+	for (auto&& record : expected)
+	{
+		if (it == table.end() || it->first != record.first || it->second != record.second) return false;
+		++it;
+	}
+	return it == table.end();
+}
+
+// inserts, reassignments and erases in random order, so that blocks are split and merged
+void fill(varlen_isam& table, map<string, string>& expected, unsigned seed)
+{
+	mt19937 rng(seed);
+	for (int i = 0; i < 20000; ++i)
+	{
+		string key = random_string(rng, 12);
+		if (rng() % 4 == 0)
+		{
+			check(table.erase(key) == expected.erase(key), "erase returns the number of erased records");
+			continue;
+		}
+		string value = random_string(rng, 60);
+		bool inserted = expected.find(key) == expected.end();
+		check(table.insert_or_assign(key, value) == inserted, "insert_or_assign tells an insert from an assignment");
+		expected[key] = value;
+	}
+}
+
+int main()
+{
+	block_provider::memory_provider provider;
+	size_t reserved = 0;
+	for (int round = 0; round < 4; ++round)
+	{
+		{
+			varlen_isam table(1024, &provider);
+			map<string, string> expected;
+			fill(table, expected, round);
+			check(same(table, expected), "the records match after splits and merges");
+			check(provider.blocks() == table.blocks(), "the provider holds the blocks of the table");
+		}
+		check(provider.blocks() == 0, "a destroyed table frees its blocks");
+		if (round == 0) reserved = provider.reserved_bytes();
+		check(provider.reserved_bytes() == reserved, "later tables reuse the freed blocks");
+	}
+
+	cout << (failures == 0 ? "OK" : "FAIL") << endl;
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,294 @@
+#pragma once
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace isam_impl
+{
+	// Append-only redo log, thread-safe.
+	// Records are buffered by append() and made durable by commit() with group commit: the first committer writes
+	// out everything appended so far and syncs it once, the others wait for it (or lead the next round), so
+	// concurrent committers share fsyncs. Every record is framed with its size and a checksum, replay() stops at
+	// the first damaged record (a write torn by a crash) and cuts it off.
+	class write_ahead_log
+	{
+	public:
+		// opens the log at path, creating it if needed, existing records are kept for replay()
+		explicit write_ahead_log(const std::string& path)
+		{
+			_file = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+			if (_file < 0) throw std::system_error(errno, std::generic_category(), "write_ahead_log: open " + path);
+			off_t size = ::lseek(_file, 0, SEEK_END);
+			if (size < 0) throw std::system_error(errno, std::generic_category(), "write_ahead_log: lseek");
+			_written = _durable = _appended = static_cast<uint64_t>(size);
+		}
+
+		write_ahead_log(const write_ahead_log&) = delete;
+		write_ahead_log& operator=(const write_ahead_log&) = delete;
+
+		~write_ahead_log()
+		{
+			try { commit(); } catch (...) {} // nobody left to report a failed write to
+			::close(_file);
+		}
+
+		// calls on_record(data, size) for every intact record from the start of the log
+		// must be called before the first append
+		template<class TFound>
+		void replay(TFound on_record)
+		{
+			std::vector<char> contents(static_cast<size_t>(_written));
+			read_all(contents.data(), contents.size());
+			size_t pos = 0;
+			while (contents.size() - pos >= frame_size)
+			{
+				uint32_t size, sum;
+				std::memcpy(&size, contents.data() + pos, 4);
+				std::memcpy(&sum, contents.data() + pos + 4, 4);
+				if (contents.size() - pos - frame_size < size || checksum(contents.data() + pos + frame_size, size) != sum) break;
+				on_record(contents.data() + pos + frame_size, static_cast<size_t>(size));
+				pos += frame_size + size;
+			}
+			if (pos != contents.size()) // torn tail -> drop it, so that new records follow the last intact one
+			{
+				if (::ftruncate(_file, static_cast<off_t>(pos)) != 0) throw std::system_error(errno, std::generic_category(), "write_ahead_log: ftruncate");
+				_written = _durable = _appended = pos;
+			}
+		}
+
+		// buffers a record, returns its log sequence number for commit()
+		uint64_t append(const void* data, size_t size)
+		{
+			uint32_t size32 = static_cast<uint32_t>(size), sum = checksum(static_cast<const char*>(data), size);
+			std::lock_guard<std::mutex> lock(_latch);
+			check_failed();
+			size_t pos = _buffer.size();
+			_buffer.resize(pos + frame_size + size);
+			std::memcpy(_buffer.data() + pos, &size32, 4);
+			std::memcpy(_buffer.data() + pos + 4, &sum, 4);
+			std::memcpy(_buffer.data() + pos + frame_size, data, size);
+			_appended += frame_size + size;
+			return _appended;
+		}
+
+		// Returns once the records up to lsn are on stable storage. A failed write or sync fails the log: the records
+		// of that round may be partly written, so this and every later commit() and append() throws.
+		void commit(uint64_t lsn)
+		{
+			std::unique_lock<std::mutex> lock(_latch);
+			while (_durable < lsn)
+			{
+				check_failed();
+				if (_flushing)
+				{
+					_flushed.wait(lock);
+					continue;
+				}
+				// lead a round: write out and sync everything appended until now
+				_flushing = true;
+				std::vector<char> batch;
+				batch.swap(_buffer);
+				uint64_t target = _appended, offset = _written;
+				lock.unlock();
+				try
+				{
+					write_all(batch.data(), batch.size(), offset);
+					if (::fdatasync(_file) != 0) throw std::system_error(errno, std::generic_category(), "write_ahead_log: fdatasync");
+				}
+				catch (...)
+				{
+					lock.lock();
+					_failed = true;
+					_flushing = false;
+					_flushed.notify_all();
+					throw;
+				}
+				lock.lock();
+				_written = _durable = target;
+				_flushing = false;
+				_flushed.notify_all();
+			}
+		}
+
+		// commits everything appended so far
+		void commit()
+		{
+			uint64_t lsn;
+			{
+				std::lock_guard<std::mutex> lock(_latch);
+				lsn = _appended;
+			}
+			commit(lsn);
+		}
+
+		// drops every record, once their effects are saved elsewhere (a checkpoint)
+		void truncate()
+		{
+			commit();
+			std::lock_guard<std::mutex> lock(_latch);
+			if (::ftruncate(_file, 0) != 0) throw std::system_error(errno, std::generic_category(), "write_ahead_log: ftruncate");
+			if (::fdatasync(_file) != 0) throw std::system_error(errno, std::generic_category(), "write_ahead_log: fdatasync");
+			_written = _durable = _appended = 0;
+		}
+
+	private:
+		static const size_t frame_size = 8; // 4b size, 4b checksum
+
+		int _file;
+		std::mutex _latch;
+		std::condition_variable _flushed;
+		std::vector<char> _buffer; // appended, not yet written
+		uint64_t _appended, _written, _durable; // log offsets
+		bool _flushing = false;
+		bool _failed = false; // a round failed, the log ends in an unknown state
+
+		// _latch must be held
+		void check_failed() const
+		{
+			if (_failed) throw std::runtime_error("write_ahead_log: an earlier write or sync failed");
+		}
+
+		// FNV-1a
+		static uint32_t checksum(const char* data, size_t size)
+		{
+			uint32_t hash = 2166136261u;
+			for (size_t i = 0; i < size; ++i)
+			{
+				hash ^= static_cast<unsigned char>(data[i]);
+				hash *= 16777619u;
+			}
+			return hash;
+		}
+
+		void read_all(char* data, size_t size) const
+		{
+			size_t done = 0;
+			while (done < size)
+			{
+				ssize_t r = ::pread(_file, data + done, size - done, static_cast<off_t>(done));
+				if (r < 0 && errno == EINTR) continue;
+				if (r < 0) throw std::system_error(errno, std::generic_category(), "write_ahead_log: pread");
+				if (r == 0) break;
+				done += static_cast<size_t>(r);
+			}
+		}
+
+		void write_all(const char* data, size_t size, uint64_t offset) const
+		{
+			size_t done = 0;
+			while (done < size)
+			{
+				ssize_t w = ::pwrite(_file, data + done, size - done, static_cast<off_t>(offset + done));
+				if (w < 0 && errno == EINTR) continue;
+				if (w < 0) throw std::system_error(errno, std::generic_category(), "write_ahead_log: pwrite");
+				done += static_cast<size_t>(w);
+			}
+		}
+	};
+
+	// Snapshot of all records of an isam, written next to its log. The file is built under a temporary name and
+	// renamed over the previous checkpoint once it is on stable storage, so a crash leaves one complete checkpoint.
+	// Layout: 8b magic, 8b record count, 4b key size, 4b value size, then the (key, value) records in key order.
+	class checkpoint_writer
+	{
+	public:
+		checkpoint_writer(const std::string& path, uint32_t key_size, uint32_t value_size) : _path(path)
+		{
+			_file = ::open((path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (_file < 0) throw std::system_error(errno, std::generic_category(), "checkpoint_writer: open " + path);
+			uint64_t header[2] = { checkpoint_magic, 0 };
+			append(header, sizeof(header));
+			append(&key_size, 4);
+			append(&value_size, 4);
+		}
+
+		checkpoint_writer(const checkpoint_writer&) = delete;
+		checkpoint_writer& operator=(const checkpoint_writer&) = delete;
+
+		~checkpoint_writer()
+		{
+			if (_file >= 0) ::close(_file);
+		}
+
+		void append(const void* data, size_t size)
+		{
+			auto bytes = static_cast<const char*>(data);
+			_buffer.insert(_buffer.end(), bytes, bytes + size);
+			if (_buffer.size() >= buffer_size) flush();
+		}
+
+		// makes the checkpoint durable and replaces the previous one
+		void finish(uint64_t count)
+		{
+			flush();
+			if (::pwrite(_file, &count, 8, 8) != 8) throw std::system_error(errno, std::generic_category(), "checkpoint_writer: pwrite");
+			if (::fsync(_file) != 0) throw std::system_error(errno, std::generic_category(), "checkpoint_writer: fsync");
+			::close(_file);
+			_file = -1;
+			if (std::rename((_path + ".tmp").c_str(), _path.c_str()) != 0) throw std::system_error(errno, std::generic_category(), "checkpoint_writer: rename");
+			// the rename itself is durable once the directory is synced
+			size_t slash = _path.find_last_of('/');
+			std::string dir = slash == std::string::npos ? "." : _path.substr(0, slash + 1);
+			int dir_file = ::open(dir.c_str(), O_RDONLY);
+			if (dir_file >= 0)
+			{
+				::fsync(dir_file);
+				::close(dir_file);
+			}
+		}
+
+	private:
+		static const size_t buffer_size = size_t(1) << 20;
+
+		std::string _path;
+		int _file;
+		std::vector<char> _buffer;
+
+		void flush()
+		{
+			size_t done = 0;
+			while (done < _buffer.size())
+			{
+				ssize_t w = ::write(_file, _buffer.data() + done, _buffer.size() - done);
+				if (w < 0 && errno == EINTR) continue;
+				if (w < 0) throw std::system_error(errno, std::generic_category(), "checkpoint_writer: write");
+				done += static_cast<size_t>(w);
+			}
+			_buffer.clear();
+		}
+
+	public:
+		static const uint64_t checkpoint_magic = 0x54504B434D415349ull; // "ISAMCKPT"
+	};
+
+	// reads the records of the checkpoint at path, returns false if there is none
+	template<class TKey, class TValue>
+	bool read_checkpoint(const std::string& path, std::vector<std::pair<TKey, TValue>>& records)
+	{
+		std::FILE* file = std::fopen(path.c_str(), "rb");
+		if (file == nullptr) return false;
+		uint64_t header[2];
+		uint32_t sizes[2];
+		bool valid = std::fread(header, 8, 2, file) == 2 && std::fread(sizes, 4, 2, file) == 2
+			&& header[0] == checkpoint_writer::checkpoint_magic && sizes[0] == sizeof(TKey) && sizes[1] == sizeof(TValue);
+		for (uint64_t i = 0; valid && i < header[1]; ++i)
+		{
+			std::pair<TKey, TValue> record;
+			valid = std::fread(&record.first, sizeof(TKey), 1, file) == 1 && std::fread(&record.second, sizeof(TValue), 1, file) == 1;
+			if (valid) records.push_back(record);
+		}
+		std::fclose(file);
+		if (!valid) throw std::runtime_error("read_checkpoint: damaged checkpoint " + path);
+		return true;
+	}
+}
@@ -0,0 +1,101 @@
+// Tests of write_ahead_log and of isam durability.
+// Build with e.g. g++ -std=c++17 -O2 write_ahead_log_test.cpp -pthread
+// Usage: write_ahead_log_test [directory for the log files], returns 0 on success.
+#include <csignal>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include "isam.hpp"
+
+using namespace std;
+
+int failures = 0;
+
+void check(bool condition, const string& what)
+{
+	if (condition) return;
+	cout << "FAIL: " << what << endl;
+	++failures;
+}
+
+// a write that fails fails every committer of its round and every later commit and append
+// the writes are made to fail by a file size limit, syncs keep working
+void test_failed_write(const string& dir)
+{
+	string path = dir + "/wal_test_failed.log";
+	std::remove(path.c_str());
+	rlimit original;
+	getrlimit(RLIMIT_FSIZE, &original);
+	rlimit limited = original;
+	limited.rlim_cur = 1024;
+	std::signal(SIGXFSZ, SIG_IGN); // pwrite fails with EFBIG instead
+	setrlimit(RLIMIT_FSIZE, &limited);
+
+	isam_impl::write_ahead_log log(path);
+	char record[2000] = {};
+	uint64_t first = log.append(record, sizeof(record));
+	uint64_t second = log.append(record, sizeof(record));
+
+	bool threw[2] = { false, false };
+	vector<thread> committers;
+	uint64_t lsns[2] = { first, second };
+	for (int i = 0; i < 2; ++i)
+	{
+		committers.emplace_back([&, i]
+		{
+			try { log.commit(lsns[i]); }
+			catch (const exception&) { threw[i] = true; }
+		});
+	}
+	for (auto& t : committers) t.join();
+	check(threw[0] && threw[1], "both committers of a failed round throw");
+
+	bool later = false;
+	try { log.commit(); log.append(record, sizeof(record)); }
+	catch (const exception&) { later = true; }
+	check(later, "a failed log refuses later appends");
+
+	setrlimit(RLIMIT_FSIZE, &original);
+	std::remove(path.c_str());
+}
+
+// the records of a reopened isam are those of the last checkpoint with the log replayed over it
+void test_replay_after_checkpoint(const string& dir)
+{
+	string path = dir + "/wal_test.log";
+	std::remove(path.c_str());
+	std::remove((path + ".ckpt").c_str());
+	{
+		isam<long, long> index(8, 4);
+		index.open_log(path);
+		for (long k = 0; k < 1000; ++k) index.insert_or_assign(k, k);
+		index.checkpoint();
+		for (long k = 0; k < 1000; k += 3) index.insert_or_assign(k, -k); // after the checkpoint: only in the log
+		index.erase(500);
+		index.erase(600, 700);
+		index.commit();
+	}
+	isam<long, long> index(8, 4);
+	index.open_log(path);
+	long count = 0, v;
+	for (auto it = index.cbegin(); it != index.cend(); ++it) ++count;
+	check(count == 1000 - 1 - 100, "record count after replay");
+	check(index.get(3, v) && v == -3, "assignment logged after the checkpoint");
+	check(index.get(4, v) && v == 4, "record from the checkpoint");
+	check(!index.contains(500) && !index.contains(650), "erases logged after the checkpoint");
+	std::remove(path.c_str());
+	std::remove((path + ".ckpt").c_str());
+}
+
+int main(int argc, char** argv)
+{
+	string dir = argc > 1 ? argv[1] : ".";
+	test_failed_write(dir);
+	test_replay_after_checkpoint(dir);
+	cout << (failures == 0 ? "OK" : "FAIL") << endl;
+	return failures == 0 ? 0 : 1;
+}